@@ -0,0 +1,105 @@
+/**
+ * \file src/cache.cc
+ * \ingroup cache
+ *
+ * Cache the parsed comment headers of Ogg files in memory.
+ *
+ * The locks are never held while reading a file. When two threads miss the same entry at the same
+ * time, they both read the file, and the last one wins.
+ */
+
+#include <opustags.h>
+
+#include <errno.h>
+#include <string.h>
+
+using namespace std::literals::string_literals;
+
+/** Estimate the memory used by an entry, including the overhead of the containers. */
+static size_t entry_cost(const ot::opus_tags& tags)
+{
+	constexpr size_t overhead = 128;
+	size_t cost = overhead + sizeof(ot::opus_tags) + tags.vendor.size() + tags.extra_data.size();
+	for (const std::string& comment : tags.comments)
+		cost += sizeof(std::string) + 2 * sizeof(void*) + comment.size();
+	return cost;
+}
+
+size_t ot::header_cache::identity_hash::operator()(const file_identity& id) const
+{
+	fnv1a_hash hash;
+	hash.update(&id.device, sizeof(id.device));
+	hash.update(&id.inode, sizeof(id.inode));
+	hash.update(&id.size, sizeof(id.size));
+	hash.update(&id.mtime.tv_sec, sizeof(id.mtime.tv_sec));
+	hash.update(&id.mtime.tv_nsec, sizeof(id.mtime.tv_nsec));
+	return hash.value;
+}
+
+ot::header_cache::header_cache(size_t max_bytes, size_t shard_count)
+	: shards(std::make_unique<shard[]>(shard_count)), shard_count(shard_count),
+	  shard_budget(max_bytes / shard_count)
+{
+}
+
+std::shared_ptr<const ot::opus_tags> ot::header_cache::get(const char* path, io_limiter* limiter)
+{
+	file_identity identity;
+	bool known = true;
+	try {
+		identity = get_file_identity(path);
+	} catch (const status&) {
+		// fopen below fails too, and reports the error like everywhere else.
+		known = false;
+	}
+	if (known) {
+		shard& s = shards[identity_hash()(identity) % shard_count];
+		std::lock_guard<std::mutex> lock(s.mutex);
+		auto it = s.index.find(identity);
+		if (it != s.index.end()) {
+			s.entries.splice(s.entries.begin(), s.entries, it->second);
+			return it->second->tags;
+		}
+	}
+
+	// Read the identity again from the opened file, in case it changed after the stat call
+	// above. This is the identity of the data we actually read.
+	ot::file input = fopen(path, "re");
+	if (input == nullptr)
+		throw status {st::standard_error,
+		              "Could not open '"s + path + "' for reading: " + strerror(errno)};
+	identity = get_file_identity(input.get());
+	entry e { identity, std::make_shared<const opus_tags>(read_tags(input.get(), limiter)), 0 };
+	e.cost = entry_cost(*e.tags);
+	shard& target = shards[identity_hash()(identity) % shard_count];
+	if (e.cost > shard_budget)
+		return e.tags;
+
+	std::lock_guard<std::mutex> lock(target.mutex);
+	auto it = target.index.find(identity);
+	if (it != target.index.end()) {
+		target.bytes -= it->second->cost;
+		target.entries.erase(it->second);
+		target.index.erase(it);
+	}
+	target.entries.push_front(e);
+	target.index.emplace(identity, target.entries.begin());
+	target.bytes += e.cost;
+	while (target.bytes > shard_budget) {
+		const entry& victim = target.entries.back();
+		target.bytes -= victim.cost;
+		target.index.erase(victim.identity);
+		target.entries.pop_back();
+	}
+	return e.tags;
+}
+
+size_t ot::header_cache::size() const
+{
+	size_t bytes = 0;
+	for (size_t i = 0; i < shard_count; ++i) {
+		std::lock_guard<std::mutex> lock(shards[i].mutex);
+		bytes += shards[i].bytes;
+	}
+	return bytes;
+}
@@ -9,13 +9,18 @@
 #include <opustags.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <thread>
+
 using namespace std::literals::string_literals;
 
 static const char help_message[] =
@@ -39,6 +44,20 @@ Options:
   -S, --set-all                 import comments from standard input
   -e, --edit                    edit tags interactively in VISUAL/EDITOR
   --raw                         disable encoding conversion
+  --background                  use the idle I/O priority
+  --io-limit BYTES              limit the I/O throughput per second
+  --ops-limit COUNT             limit the I/O operations per second
+  --emit-delta FILE             record the edits made with --in-place
+  --apply-delta FILE            replay the edits recorded with --emit-delta
+  --jobs COUNT                  process COUNT files at the same time
+  --copy-threads COUNT          copy the audio of each file on COUNT threads
+  --manifest FILE               write the hashes of the headers and of the audio
+  --check-manifest FILE         list the files changed since --manifest
+  --check-audio                 check the audio too with --check-manifest
+  --resumable[=BYTES]           save the progress of rewrites every BYTES
+  --add-index                   index the audio with Ogg Skeleton for fast seeking
+  --input-format FORMAT         read --set-all comments as text, json or nul
+  --expect FILE                 check the tags against those listed in FILE
 
 See the man page for extensive documentation.
 )raw";
@@ -55,9 +74,58 @@ static struct option getopt_options[] = {
 	{"set-all", no_argument, 0, 'S'},
 	{"edit", no_argument, 0, 'e'},
 	{"raw", no_argument, 0, 'r'},
+	{"background", no_argument, 0, 'b'},
+	{"io-limit", required_argument, 0, 'L'},
+	{"ops-limit", required_argument, 0, 'O'},
+	{"emit-delta", required_argument, 0, 'E'},
+	{"apply-delta", required_argument, 0, 'P'},
+	{"jobs", required_argument, 0, 'j'},
+	{"copy-threads", required_argument, 0, 'T'},
+	{"manifest", required_argument, 0, 'M'},
+	{"check-manifest", required_argument, 0, 'C'},
+	{"check-audio", no_argument, 0, 'A'},
+	{"resumable", optional_argument, 0, 'R'},
+	{"add-index", no_argument, 0, 'I'},
+	{"input-format", required_argument, 0, 'F'},
+	{"expect", required_argument, 0, 'X'},
 	{NULL, 0, 0, 0}
 };
 
+/**
+ * Parse a positive rate like 500, 64K, or 10M. The K, M and G suffixes are powers of 1024.
+ *
+ * Also used for the operation count of --ops-limit, where the suffixes are harmless.
+ */
+static uint64_t parse_rate(const char* value, const char* option)
+{
+	// strtoull would accept signs and negate the value.
+	if (*value < '0' || *value > '9')
+		throw ot::status {ot::st::bad_arguments, "Invalid value for "s + option + ": " + value + "."};
+	char* end;
+	errno = 0;
+	unsigned long long rate = strtoull(value, &end, 10);
+	uint64_t unit = 1;
+	switch (*end) {
+	case 'K': unit = 1ull << 10; ++end; break;
+	case 'M': unit = 1ull << 20; ++end; break;
+	case 'G': unit = 1ull << 30; ++end; break;
+	}
+	if (errno != 0 || end == value || *end != '\0' || rate == 0 || rate > UINT64_MAX / unit)
+		throw ot::status {ot::st::bad_arguments, "Invalid value for "s + option + ": " + value + "."};
+	return rate * unit;
+}
+
+/** Parse a positive count, like a number of threads, without any suffix. */
+static size_t parse_count(const char* value, const char* option)
+{
+	char* end;
+	errno = 0;
+	unsigned long long count = strtoull(value, &end, 10);
+	if (*value < '0' || *value > '9' || errno != 0 || *end != '\0' || count == 0 || count > SIZE_MAX)
+		throw ot::status {ot::st::bad_arguments, "Invalid value for "s + option + ": " + value + "."};
+	return count;
+}
+
 ot::options ot::parse_options(int argc, char** argv, FILE* comments_input)
 {
 	options opt;
@@ -96,7 +164,7 @@ ot::options ot::parse_options(int argc, char** argv, FILE* comments_input)
 			if (equal == nullptr)
 				throw status {st::bad_arguments, "Comment does not contain an equal sign: "s + optarg + "."};
 			if (c == 's')
-				opt.to_delete.emplace_back(optarg, equal - optarg);
+				opt.to_set.emplace_back(optarg, equal - optarg);
 			opt.to_add.emplace_back(optarg);
 			break;
 		case 'S':
@@ -112,6 +180,55 @@ ot::options ot::parse_options(int argc, char** argv, FILE* comments_input)
 		case 'r':
 			opt.raw = true;
 			break;
+		case 'b':
+			opt.background = true;
+			break;
+		case 'L':
+			opt.io_bytes_per_second = parse_rate(optarg, "--io-limit");
+			break;
+		case 'O':
+			opt.io_ops_per_second = parse_rate(optarg, "--ops-limit");
+			break;
+		case 'E':
+			opt.emit_delta = optarg;
+			break;
+		case 'P':
+			opt.apply_delta = optarg;
+			break;
+		case 'j':
+			opt.jobs = parse_count(optarg, "--jobs");
+			break;
+		case 'T':
+			opt.copy_threads = parse_count(optarg, "--copy-threads");
+			break;
+		case 'M':
+			opt.manifest = optarg;
+			break;
+		case 'C':
+			opt.check_manifest = optarg;
+			break;
+		case 'A':
+			opt.check_audio = true;
+			break;
+		case 'R':
+			opt.checkpoint_interval = optarg ? parse_rate(optarg, "--resumable") : 64 << 20;
+			break;
+		case 'I':
+			opt.add_index = true;
+			break;
+		case 'F':
+			if (strcmp(optarg, "text") == 0)
+				opt.input_format = comment_format::text;
+			else if (strcmp(optarg, "json") == 0)
+				opt.input_format = comment_format::json;
+			else if (strcmp(optarg, "nul") == 0)
+				opt.input_format = comment_format::nul;
+			else
+				throw status {st::bad_arguments, "Invalid value for --input-format: "s + optarg + "."};
+			break;
+		case 'X':
+			opt.expect = optarg;
+			break;
 		case ':':
 			throw status {st::bad_arguments, "Missing value for option '"s + argv[optind - 1] + "'."};
 		default:
@@ -131,7 +248,7 @@ ot::options ot::parse_options(int argc, char** argv, FILE* comments_input)
 
 	// Convert arguments to UTF-8.
 	if (!opt.raw) {
-		for (std::list<std::string>* args : { &opt.to_add, &opt.to_delete }) {
+		for (std::list<std::string>* args : { &opt.to_add, &opt.to_delete, &opt.to_set }) {
 			try {
 				for (std::string& arg : *args)
 					arg = to_utf8(arg);
@@ -141,12 +258,64 @@ ot::options ot::parse_options(int argc, char** argv, FILE* comments_input)
 		}
 	}
 
+	if (opt.add_index && (opt.apply_delta || opt.manifest || opt.check_manifest || opt.expect))
+		throw status {st::bad_arguments, "Cannot use --add-index with --apply-delta or manifests."};
+
+	if (opt.apply_delta) {
+		// The deltas name the files to edit, and specify the edits themselves.
+		if (!opt.paths_in.empty())
+			throw status {st::bad_arguments, "Cannot specify input files with --apply-delta."};
+		if (opt.path_out || opt.in_place || opt.edit_interactively || opt.emit_delta ||
+		    opt.delete_all || !opt.to_add.empty() || !opt.to_delete.empty() || !opt.to_set.empty())
+			throw status {st::bad_arguments, "Cannot mix --apply-delta with -oieadDsS or --emit-delta."};
+		return opt;
+	}
+
+	if (opt.check_audio && !opt.check_manifest)
+		throw status {st::bad_arguments, "Cannot use --check-audio without --check-manifest."};
+
+	if (opt.manifest || opt.check_manifest || opt.expect) {
+		// Manifests only read the files.
+		if (opt.manifest && opt.check_manifest)
+			throw status {st::bad_arguments, "Cannot combine --manifest and --check-manifest."};
+		if (opt.expect && (opt.manifest || opt.check_manifest))
+			throw status {st::bad_arguments, "Cannot combine --expect with --manifest or --check-manifest."};
+		if (opt.path_out || opt.in_place || opt.edit_interactively || opt.emit_delta ||
+		    opt.delete_all || !opt.to_add.empty() || !opt.to_delete.empty() || !opt.to_set.empty())
+			throw status {st::bad_arguments, "Cannot mix manifests with -oieadDsS or --emit-delta."};
+		if (opt.check_manifest && !opt.paths_in.empty())
+			throw status {st::bad_arguments, "Cannot specify input files with --check-manifest."};
+		if (opt.expect && !opt.paths_in.empty())
+			throw status {st::bad_arguments, "Cannot specify input files with --expect."};
+		if (opt.manifest && opt.paths_in.empty())
+			throw status {st::bad_arguments, "No input files specified for --manifest."};
+		// The manifest entries are checked by reopening their path.
+		if (opt.manifest && std::find(opt.paths_in.begin(), opt.paths_in.end(), "-") != opt.paths_in.end())
+			throw status {st::bad_arguments, "Cannot read standard input with --manifest."};
+		return opt;
+	}
+
 	if (opt.in_place && opt.path_out)
 		throw status {st::bad_arguments, "Cannot combine --in-place and --output."};
 
+	if (opt.emit_delta && !opt.in_place)
+		throw status {st::bad_arguments, "Cannot use --emit-delta without --in-place."};
+
 	if (opt.in_place && stdin_as_input)
 		throw status {st::bad_arguments, "Cannot modify standard input in place."};
 
+	if (opt.checkpoint_interval && stdin_as_input)
+		throw status {st::bad_arguments, "Cannot resume rewrites from standard input."};
+
+	if (opt.add_index && !opt.in_place && !opt.path_out)
+		throw status {st::bad_arguments, "Cannot use --add-index without --output or --in-place."};
+
+	if (opt.add_index && opt.path_out == "-")
+		throw status {st::bad_arguments, "Cannot add an index when writing to standard output."};
+
+	if (opt.add_index && (opt.emit_delta || opt.checkpoint_interval))
+		throw status {st::bad_arguments, "Cannot combine --add-index with --emit-delta or --resumable."};
+
 	if ((!opt.in_place || opt.edit_interactively) && opt.paths_in.size() != 1)
 		throw status {st::bad_arguments, "Exactly one input file must be specified."};
 
@@ -159,12 +328,16 @@ ot::options ot::parse_options(int argc, char** argv, FILE* comments_input)
 	if (opt.edit_interactively && !opt.path_out.has_value() && !opt.in_place)
 		throw status {st::bad_arguments, "Cannot edit interactively when no output is specified."};
 
-	if (opt.edit_interactively && (opt.delete_all || !opt.to_add.empty() || !opt.to_delete.empty()))
+	if (opt.edit_interactively && (opt.delete_all || !opt.to_add.empty() || !opt.to_delete.empty() ||
+	                               !opt.to_set.empty()))
 		throw status {st::bad_arguments, "Cannot mix --edit with -adDsS."};
 
+	if (opt.input_format != comment_format::text && !set_all)
+		throw status {st::bad_arguments, "Cannot use --input-format without --set-all."};
+
 	if (set_all) {
 		// Read comments from stdin and prepend them to opt.to_add.
-		std::list<std::string> comments = read_comments(comments_input, opt.raw);
+		std::list<std::string> comments = read_comments(comments_input, opt.raw, opt.input_format);
 		opt.to_add.splice(opt.to_add.begin(), std::move(comments));
 	}
 	return opt;
@@ -213,20 +386,263 @@ void ot::print_comments(const std::list<std::string>& comments, FILE* output, bo
 		fputs("warning: Some tags contain control characters.\n", stderr);
 }
 
-std::list<std::string> ot::read_comments(FILE* input, bool raw)
+namespace {
+
+/**
+ * Streaming parser for #ot::comment_format::json. It reads the input one byte at a time from the
+ * stdio buffer, and appends each comment to the list as soon as it is complete.
+ *
+ * Only what comment lists are made of is supported: arrays, objects and strings.
+ */
+class json_comment_reader {
+public:
+	json_comment_reader(FILE* input, bool raw) : input(input), raw(raw) {}
+	/** Read a whole input made of a single list of comments. */
+	void read(std::list<std::string>& comments);
+	/**
+	 * Read the next member of an input made of an object mapping paths to lists of comments,
+	 * and return false at the end of the object.
+	 */
+	bool next_entry(std::string& path, std::list<std::string>& comments);
+private:
+	int next() {
+		int c = getc(input);
+		if (c != EOF)
+			++offset;
+		return c;
+	}
+	/** Skip the whitespace and return the next character. */
+	int next_token();
+	/** Append the string whose opening quote was just read to out. */
+	void read_string(std::string& out);
+	uint32_t read_hex4();
+	/** Read a comment, or an array of comments. name is the field name of an object member. */
+	void read_values(int c, std::list<std::string>& comments, const std::string* name);
+	/** Read a list of comments, as an array or an object, starting with the character c. */
+	void read_list(int c, std::list<std::string>& comments);
+	/** Check that nothing but whitespace follows. */
+	void read_end();
+	[[noreturn]] void fail(const std::string& what) const {
+		throw ot::status {ot::st::error, "Invalid JSON input at byte " + std::to_string(offset) +
+		                                 ": " + what + "."};
+	}
+	FILE* input;
+	bool raw;
+	size_t offset = 0;
+	/** For #next_entry, whether the opening brace was read. */
+	bool started = false;
+};
+
+}
+
+int json_comment_reader::next_token()
+{
+	int c;
+	do {
+		c = next();
+	} while (c == ' ' || c == '\t' || c == '\n' || c == '\r');
+	return c;
+}
+
+uint32_t json_comment_reader::read_hex4()
+{
+	uint32_t value = 0;
+	for (int i = 0; i < 4; ++i) {
+		int c = next();
+		int digit;
+		if (c >= '0' && c <= '9')
+			digit = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			digit = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			digit = c - 'A' + 10;
+		else
+			fail("expected 4 hexadecimal digits after \\u");
+		value = (value << 4) | digit;
+	}
+	return value;
+}
+
+void json_comment_reader::read_string(std::string& out)
+{
+	size_t start = out.size();
+	for (;;) {
+		int c = next();
+		if (c == '"')
+			break;
+		if (c == EOF)
+			fail("unterminated string");
+		if (c < 0x20)
+			fail("unescaped control character in a string");
+		if (c != '\\') {
+			out += static_cast<char>(c);
+			continue;
+		}
+		switch (c = next()) {
+		case '"': case '\\': case '/': out += static_cast<char>(c); break;
+		case 'b': out += '\b'; break;
+		case 'f': out += '\f'; break;
+		case 'n': out += '\n'; break;
+		case 'r': out += '\r'; break;
+		case 't': out += '\t'; break;
+		case 'u': {
+			uint32_t code_point = read_hex4();
+			if (code_point >= 0xDC00 && code_point <= 0xDFFF)
+				fail("unpaired surrogate");
+			if (code_point >= 0xD800 && code_point <= 0xDBFF) {
+				if (next() != '\\' || next() != 'u')
+					fail("unpaired surrogate");
+				uint32_t low = read_hex4();
+				if (low < 0xDC00 || low > 0xDFFF)
+					fail("unpaired surrogate");
+				code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+			}
+			if (code_point < 0x80) {
+				out += static_cast<char>(code_point);
+			} else if (code_point < 0x800) {
+				out += static_cast<char>(0xC0 | (code_point >> 6));
+				out += static_cast<char>(0x80 | (code_point & 0x3F));
+			} else if (code_point < 0x10000) {
+				out += static_cast<char>(0xE0 | (code_point >> 12));
+				out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+				out += static_cast<char>(0x80 | (code_point & 0x3F));
+			} else {
+				out += static_cast<char>(0xF0 | (code_point >> 18));
+				out += static_cast<char>(0x80 | ((code_point >> 12) & 0x3F));
+				out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+				out += static_cast<char>(0x80 | (code_point & 0x3F));
+			}
+			break;
+		}
+		default:
+			fail("invalid escape sequence");
+		}
+	}
+	if (!raw && !ot::is_utf8(std::string_view(out).substr(start)))
+		throw ot::status {ot::st::badly_encoded, "Invalid UTF-8 in JSON input at byte " +
+		                                         std::to_string(offset) + "."};
+}
+
+void json_comment_reader::read_values(int c, std::list<std::string>& comments, const std::string* name)
+{
+	auto read_value = [&] {
+		if (c != '"')
+			fail(name ? "expected a string or an array of strings" : "expected a string");
+		std::string comment;
+		if (name) {
+			comment.reserve(name->size() + 1);
+			comment += *name;
+			comment += '=';
+		}
+		read_string(comment);
+		if (!name && comment.find('=') == std::string::npos)
+			throw ot::status {ot::st::error, "Malformed tag: " + comment};
+		comments.push_back(std::move(comment));
+	};
+	if (name && c != '[') {
+		read_value();
+		return;
+	}
+	if (c != '[')
+		fail("expected an array or an object");
+	if ((c = next_token()) == ']')
+		return;
+	for (;;) {
+		read_value();
+		if ((c = next_token()) == ']')
+			return;
+		if (c != ',')
+			fail("expected ',' or ']'");
+		c = next_token();
+	}
+}
+
+void json_comment_reader::read_list(int c, std::list<std::string>& comments)
+{
+	if (c != '{') {
+		read_values(c, comments, nullptr);
+	} else if ((c = next_token()) != '}') {
+		std::string name;
+		for (;;) {
+			if (c != '"')
+				fail("expected a field name");
+			name.clear();
+			read_string(name);
+			if (name.empty() || name.find('=') != std::string::npos)
+				fail("invalid field name '" + name + "'");
+			if (next_token() != ':')
+				fail("expected ':'");
+			read_values(next_token(), comments, &name);
+			if ((c = next_token()) == '}')
+				break;
+			if (c != ',')
+				fail("expected ',' or '}'");
+			c = next_token();
+		}
+	}
+}
+
+void json_comment_reader::read_end()
+{
+	if (next_token() != EOF)
+		fail("unexpected data after the comments");
+	if (ferror(input))
+		throw ot::status {ot::st::standard_error, "fread error: "s + strerror(errno)};
+}
+
+void json_comment_reader::read(std::list<std::string>& comments)
+{
+	read_list(next_token(), comments);
+	read_end();
+}
+
+bool json_comment_reader::next_entry(std::string& path, std::list<std::string>& comments)
+{
+	int c = next_token();
+	if (!started) {
+		if (c != '{')
+			fail("expected an object");
+		started = true;
+		c = next_token();
+	} else if (c != '}') {
+		if (c != ',')
+			fail("expected ',' or '}'");
+		c = next_token();
+	}
+	if (c == '}') {
+		read_end();
+		return false;
+	}
+	if (c != '"')
+		fail("expected a path");
+	path.clear();
+	read_string(path);
+	if (next_token() != ':')
+		fail("expected ':'");
+	comments.clear();
+	read_list(next_token(), comments);
+	return true;
+}
+
+std::list<std::string> ot::read_comments(FILE* input, bool raw, comment_format format)
 {
 	std::list<std::string> comments;
+	if (format == comment_format::json) {
+		json_comment_reader(input, raw).read(comments);
+		return comments;
+	}
+
 	static ot::encoding_converter to_utf8("", "UTF-8");
-	comments.clear();
+	int delimiter = format == comment_format::nul ? '\0' : '\n';
 	char* line = nullptr;
 	size_t buflen = 0;
 	ssize_t nread;
-	while ((nread = getline(&line, &buflen, input)) != -1) {
-		if (nread > 0 && line[nread - 1] == '\n')
+	while ((nread = getdelim(&line, &buflen, delimiter, input)) != -1) {
+		if (nread > 0 && line[nread - 1] == delimiter)
 			--nread;
 		if (nread == 0)
 			continue;
-		if (line[0] == '#') // comment
+		if (format == comment_format::text && line[0] == '#') // comment
 			continue;
 		if (memchr(line, '=', nread) == nullptr) {
 			ot::status rc = {ot::st::error, "Malformed tag: " + std::string(line, nread)};
@@ -271,6 +687,54 @@ void ot::delete_comments(std::list<std::string>& comments, const std::string& se
 	}
 }
 
+/** Check if the comment is of the form NAME=VALUE, with NAME compared case-insensitively. */
+static bool has_field_name(const std::string& comment, std::string_view name)
+{
+	return comment.size() > name.size() && comment[name.size()] == '=' &&
+	       strncasecmp(comment.data(), name.data(), name.size()) == 0;
+}
+
+void ot::set_comments(std::list<std::string>& comments, const std::list<std::string>& additions,
+                      const std::list<std::string>& fields)
+{
+	// For each replaced field, keep its first comment as an anchor to insert the new comments
+	// before, and remove all the other ones. The anchors are removed at the end.
+	using anchor = std::pair<std::string_view, std::list<std::string>::iterator>;
+	std::vector<anchor> anchors;
+	for (const std::string& name : fields) {
+		auto duplicate = [&](const anchor& a) { return has_field_name(*a.second, name); };
+		if (std::any_of(anchors.begin(), anchors.end(), duplicate))
+			continue;
+		auto first = comments.end();
+		auto it = comments.begin(), end = comments.end();
+		while (it != end) {
+			auto current = it++;
+			if (!has_field_name(*current, name))
+				continue;
+			if (first == end)
+				first = current;
+			else
+				comments.erase(current);
+		}
+		if (first != end)
+			anchors.emplace_back(name, first);
+	}
+
+	for (const std::string& comment : additions) {
+		auto where = comments.end();
+		for (const anchor& a : anchors) {
+			if (has_field_name(comment, a.first)) {
+				where = a.second;
+				break;
+			}
+		}
+		comments.insert(where, comment);
+	}
+
+	for (const anchor& a : anchors)
+		comments.erase(a.second);
+}
+
 /** Apply the modifications requested by the user to the opustags packet. */
 static void edit_tags(ot::opus_tags& tags, const ot::options& opt)
 {
@@ -280,8 +744,7 @@ static void edit_tags(ot::opus_tags& tags, const ot::options& opt)
 		ot::delete_comments(tags.comments, name.c_str());
 	}
 
-	for (const std::string& comment : opt.to_add)
-		tags.comments.emplace_back(comment);
+	ot::set_comments(tags.comments, opt.to_add, opt.to_set);
 }
 
 /** Spawn VISUAL or EDITOR to edit the given tags. */
@@ -348,19 +811,161 @@ static void edit_tags_interactively(ot::opus_tags& tags, const std::optional<std
 	remove(tags_path.c_str());
 }
 
+/**
+ * Progress of a resumable rewrite, saved in a #ot::rewrite_state every so many bytes.
+ */
+struct rewrite_checkpoint {
+	/** Path to the state file. */
+	std::string state_path;
+	/** State of the previous attempt when resuming, then the state of the current one. */
+	ot::rewrite_state state;
+	/** True when the partial file contains the progress of a previous attempt. */
+	bool resuming = false;
+	/** The partial file, to keep as soon as it contains progress worth resuming. */
+	ot::partial_file* partial;
+	/** Minimum number of bytes written between two saves. */
+	uint64_t interval;
+	/** Number of bytes written in the partial file so far. */
+	uint64_t written = 0;
+	/** Number of bytes written at which the next save is due. */
+	uint64_t next_save = 0;
+};
+
+/** Truncate a file opened for writing, after flushing it. */
+static void truncate_output(FILE* output, uint64_t size)
+{
+	if (fflush(output) != 0)
+		throw ot::status {ot::st::standard_error, "fflush error: "s + strerror(errno)};
+	if (ftruncate(fileno(output), size) == -1)
+		throw ot::status {ot::st::standard_error, "ftruncate error: "s + strerror(errno)};
+}
+
+/**
+ * Continue a resumable rewrite once the headers are written at the beginning of the partial file.
+ * When the headers are the same as in the previous attempt, skip the pages it already copied.
+ * Otherwise, the edit changed, and the previous progress is discarded.
+ */
+static void resume_rewrite(rewrite_checkpoint& checkpoint, ot::ogg_reader& reader,
+                           ot::ogg_writer& writer, uint64_t header_checksum, uint64_t header_length)
+{
+	ot::rewrite_state& state = checkpoint.state;
+	if (checkpoint.resuming && state.header_checksum == header_checksum &&
+	    state.header_length == header_length) {
+		reader.seek(state.input_offset);
+		truncate_output(writer.file, state.output_offset);
+		if (fseeko(writer.file, state.output_offset, SEEK_SET) == -1)
+			throw ot::status {ot::st::standard_error, "fseeko error: "s + strerror(errno)};
+		checkpoint.written = state.output_offset;
+	} else {
+		truncate_output(writer.file, header_length);
+		checkpoint.resuming = false;
+		checkpoint.partial->keep(false);
+		checkpoint.written = header_length;
+	}
+	state.header_checksum = header_checksum;
+	state.header_length = header_length;
+	checkpoint.next_save = checkpoint.written + checkpoint.interval;
+}
+
+/**
+ * Account for the page just copied, and save the progress when due. The partial file is synced
+ * first, so that the state never refers to data that could still be lost.
+ */
+static void save_progress(rewrite_checkpoint& checkpoint, const ot::ogg_reader& reader,
+                          ot::ogg_writer& writer)
+{
+	uint64_t page_size = reader.page.header_len + reader.page.body_len;
+	checkpoint.written += page_size;
+	if (checkpoint.written < checkpoint.next_save)
+		return;
+	if (fflush(writer.file) != 0 || fdatasync(fileno(writer.file)) == -1)
+		throw ot::status {ot::st::standard_error, "Could not sync the partial file: "s + strerror(errno)};
+	ot::rewrite_state& state = checkpoint.state;
+	state.input_offset = reader.page_offset + page_size;
+	state.output_offset = checkpoint.written;
+	state.last_page_offset = checkpoint.written - page_size;
+	state.last_pageno = ogg_page_pageno(&reader.page);
+	ot::save_rewrite_state(checkpoint.state_path, state);
+	checkpoint.partial->keep();
+	checkpoint.next_save = checkpoint.written + checkpoint.interval;
+}
+
+/**
+ * Copy the audio following the headers last read with #ot::copy_range, which requires both files
+ * to be regular files. Return false when the pages must be copied one by one instead.
+ */
+static bool copy_audio(ot::ogg_reader& reader, ot::ogg_writer& writer, size_t threads)
+{
+	int input = fileno(reader.file);
+	int output = fileno(writer.file);
+	struct stat input_info, output_info;
+	if (fstat(input, &input_info) == -1 || fstat(output, &output_info) == -1)
+		throw ot::status {ot::st::standard_error, "fstat error: "s + strerror(errno)};
+	// Positioned writes cannot go to pipes, and would be appended anyway with O_APPEND.
+	if (!S_ISREG(input_info.st_mode) || !S_ISREG(output_info.st_mode) ||
+	    (fcntl(output, F_GETFL) & O_APPEND))
+		return false;
+	uint64_t input_offset = reader.page_offset + reader.page.header_len + reader.page.body_len;
+	if (input_offset > static_cast<uint64_t>(input_info.st_size))
+		return false;
+	if (fflush(writer.file) != 0)
+		throw ot::status {ot::st::standard_error, "fflush error: "s + strerror(errno)};
+	off_t output_offset = ftello(writer.file);
+	if (output_offset == -1)
+		throw ot::status {ot::st::standard_error, "ftello error: "s + strerror(errno)};
+	ot::copy_range(input, input_offset, output, output_offset, input_info.st_size - input_offset,
+	               threads, writer.limiter);
+	if (fseeko(writer.file, 0, SEEK_END) == -1)
+		throw ot::status {ot::st::standard_error, "fseeko error: "s + strerror(errno)};
+	return true;
+}
+
 /**
  * Main loop of opustags. Read the packets from the reader, and forwards them to the writer.
  * Transform the OpusTags packet on the fly.
  *
  * The writer is optional. When writer is nullptr, opustags runs in read-only mode.
+ *
+ * When delta is not null, the header edit is recorded in it, except for the path and the file size
+ * left to the caller. If the headers did not change, the delta data is left empty.
+ *
+ * The comment header may be followed by other header packets, like the setup header of Vorbis, and
+ * they may share pages. They are all rewritten together, and when the number of header pages
+ * changes, the following pages are renumbered.
+ *
+ * Ogg Skeleton streams are skipped when reading. Since the offsets of their index would not survive
+ * a rewrite, files having one are only rewritten with --add-index, which replaces it with a new
+ * one indexing the audio pages as they are copied.
+ *
+ * With --copy-threads, the audio is copied as a single byte range when its pages need no change,
+ * that is when they keep their numbers and are neither indexed nor checkpointed. It is then not
+ * parsed, like with --apply-delta.
  */
-static void process(ot::ogg_reader& reader, ot::ogg_writer* writer, const ot::options &opt)
+static void process(ot::ogg_reader& reader, ot::ogg_writer* writer, const ot::options &opt,
+                    ot::header_delta* delta = nullptr, rewrite_checkpoint* checkpoint = nullptr)
 {
 	bool focused = false; /*< the stream on which we operate is defined */
 	int focused_serialno; /*< when focused, the serialno of the focused stream */
+	size_t stream_page_no = 0; /*< number of pages of the focused stream read so far */
+	std::vector<int> skeleton_serialnos; /*< Skeleton streams of the input, left out */
+	ot::codec format; /*< codec of the focused stream */
+	long page_shift = 0; /*< difference between the output and input page numbers */
+	uint64_t id_page_size = 0; /*< size of the identification header page */
+	ot::fnv1a_hash header_hash; /*< when recording a delta, hash of the header pages */
+	ot::fnv1a_hash output_header_hash; /*< when resumable, hash of the headers written */
+	std::optional<ot::skeleton_index> index; /*< when adding an index, the Skeleton stream */
 	while (reader.next_page()) {
 		auto serialno = ogg_page_serialno(&reader.page);
 		auto pageno = ogg_page_pageno(&reader.page);
+		if (ot::is_skeleton_stream(reader.page)) {
+			if (writer && !opt.add_index)
+				throw ot::status {ot::st::error,
+				                  "Cannot rewrite a file with an Ogg Skeleton stream without --add-index."};
+			skeleton_serialnos.push_back(serialno);
+			continue;
+		}
+		if (std::find(skeleton_serialnos.begin(), skeleton_serialnos.end(), serialno) != skeleton_serialnos.end())
+			continue;
 		if (!focused) {
 			focused = true;
 			focused_serialno = serialno;
@@ -368,35 +973,92 @@ static void process(ot::ogg_reader& reader, ot::ogg_writer* writer, const ot::op
 			/** \todo Support mixed streams. */
 			throw ot::status {ot::st::error, "Muxed streams are not supported yet."};
 		}
-		if (reader.absolute_page_no == 0) { // Identification header
-			if (!ot::is_opus_stream(reader.page))
-				throw ot::status {ot::st::error, "Not an Opus stream."};
+		if (stream_page_no++ == 0) { // Identification header
+			// The identification header is copied as is.
+			for (ot::fnv1a_hash* hash : {&header_hash, &output_header_hash}) {
+				hash->update(reader.page.header, reader.page.header_len);
+				hash->update(reader.page.body, reader.page.body_len);
+			}
+			id_page_size = reader.page.header_len + reader.page.body_len;
+			format = ot::identify_stream(reader.page);
+			if (format == ot::codec::unknown)
+				throw ot::status {ot::st::error, "Not an Opus, Vorbis or FLAC stream."};
+			if (writer && opt.add_index) {
+				ogg_packet identification;
+				identification.packet = reader.page.body;
+				identification.bytes = reader.page.body_len;
+				index.emplace(serialno, format, identification,
+				              ot::get_file_identity(reader.file).size);
+				index->write_head(*writer);
+			}
 			if (writer)
 				writer->write_page(reader.page);
-		} else if (reader.absolute_page_no == 1) { // Comment header
-			ot::opus_tags tags;
-			reader.process_header_packet([&tags](ogg_packet& p) { tags = ot::parse_tags(p); });
+		} else if (stream_page_no == 2) { // Comment header, and the other headers
+			uint64_t headers_offset = reader.page_offset;
+			std::string original;
+			std::vector<ot::dynamic_ogg_packet> headers;
+			reader.read_header_packets([&](ogg_packet& p) {
+				headers.emplace_back(p);
+				return !ot::is_last_header_packet(format, p, headers.size());
+			}, delta ? &original : nullptr);
+			ot::opus_tags tags = ot::parse_tags(headers.front(), format);
 			edit_tags(tags, opt);
 			if (writer) {
 				if (opt.edit_interactively) {
 					fflush(writer->file); // flush before calling the subprocess
 					edit_tags_interactively(tags, writer->path, opt.raw);
 				}
-				auto packet = ot::render_tags(tags);
-				writer->write_header_packet(serialno, pageno, packet);
+				headers.front() = ot::render_tags(tags);
+				std::string header_pages;
+				size_t page_count = writer->write_header_packets(serialno, pageno, headers,
+				                                                 delta || checkpoint ? &header_pages : nullptr);
+				page_shift = pageno + page_count - 1 - ogg_page_pageno(&reader.page);
+				if (index)
+					index->write_headers(*writer, 1 + headers.size());
+				if (checkpoint) {
+					output_header_hash.update(header_pages.data(), header_pages.size());
+					resume_rewrite(*checkpoint, reader, *writer, output_header_hash.value,
+					               id_page_size + header_pages.size());
+				}
+				if (delta) {
+					delta->data = std::move(header_pages);
+					header_hash.update(original.data(), original.size());
+					delta->offset = headers_offset;
+					delta->length = original.size();
+					delta->checksum = header_hash.value;
+					delta->page_shift = page_shift;
+					if (delta->data == original)
+						delta->data.clear();
+				}
+				if (opt.copy_threads > 1 && page_shift == 0 && !index && !checkpoint &&
+				    skeleton_serialnos.empty() && copy_audio(reader, *writer, opt.copy_threads))
+					return;
 			} else {
 				ot::print_comments(tags.comments, stdout, opt.raw);
 				break;
 			}
 		} else if (writer) {
+			if (page_shift != 0)
+				ot::renumber_page(reader.page, pageno + page_shift);
+			if (index)
+				index->add_page(reader.page);
 			writer->write_page(reader.page);
+			if (checkpoint)
+				save_progress(*checkpoint, reader, *writer);
 		}
 	}
-	if (reader.absolute_page_no < 1)
+	if (stream_page_no < 2)
 		throw ot::status {ot::st::error, "Expected at least 2 Ogg pages."};
+	if (index)
+		index->finish(*writer);
 }
 
-static void run_single(const ot::options& opt, const std::string& path_in, const std::optional<std::string>& path_out)
+/**
+ * Process a single file. When delta is not null, the edit is recorded into it. Its data is left
+ * empty when the headers did not change.
+ */
+static void run_single(const ot::options& opt, const std::string& path_in, const std::optional<std::string>& path_out,
+                       ot::io_limiter* limiter, ot::header_delta* delta)
 {
 	ot::file input;
 	if (path_in == "-")
@@ -405,6 +1067,7 @@ static void run_single(const ot::options& opt, const std::string& path_in, const
 		throw ot::status {ot::st::standard_error,
 		                  "Could not open '" + path_in + "' for reading: " + strerror(errno)};
 	ot::ogg_reader reader(input.get());
+	reader.limiter = limiter;
 
 	/* Read-only mode. */
 	if (!path_out) {
@@ -434,6 +1097,31 @@ static void run_single(const ot::options& opt, const std::string& path_in, const
 	FILE* output = nullptr;
 	ot::partial_file temporary_output;
 	ot::file final_output;
+	std::optional<rewrite_checkpoint> checkpoint;
+
+	auto open_temporary = [&] {
+		if (!opt.checkpoint_interval) {
+			temporary_output.open(path_out->c_str());
+			return temporary_output.get();
+		}
+		// Resume the previous attempt if the input did not change and its progress is intact.
+		checkpoint.emplace();
+		checkpoint->state_path = ot::rewrite_state_path(*path_out);
+		checkpoint->partial = &temporary_output;
+		checkpoint->interval = opt.checkpoint_interval;
+		ot::rewrite_state& state = checkpoint->state;
+		ot::file_identity input_identity = ot::get_file_identity(input.get());
+		bool resume = ot::load_rewrite_state(checkpoint->state_path, state) &&
+		              state.input == input_identity;
+		resume = temporary_output.open_resumable(path_out->c_str(), resume) &&
+		         ot::check_tail_page(temporary_output.get(), state);
+		if (fseeko(temporary_output.get(), 0, SEEK_SET) == -1)
+			throw ot::status {ot::st::standard_error, "fseeko error: "s + strerror(errno)};
+		checkpoint->resuming = resume;
+		temporary_output.keep(resume);
+		state.input = input_identity;
+		return temporary_output.get();
+	};
 
 	struct stat output_info;
 	if (path_out == "-") {
@@ -447,22 +1135,273 @@ static void run_single(const ot::options& opt, const std::string& path_in, const
 				                  "Could not open '" + path_out.value() + "' for writing: " + strerror(errno)};
 			output = final_output.get();
 		} else if (opt.overwrite) {
-			temporary_output.open(path_out->c_str());
-			output = temporary_output.get();
+			output = open_temporary();
 		} else {
 			throw ot::status {ot::st::error, "'" + path_out.value() + "' already exists. Use -y to overwrite."};
 		}
 	} else if (errno == ENOENT) {
-		temporary_output.open(path_out->c_str());
-		output = temporary_output.get();
+		output = open_temporary();
 	} else {
 		throw ot::status {ot::st::error, "Could not identify '" + path_in + "': " + strerror(errno)};
 	}
 
 	ot::ogg_writer writer(output);
 	writer.path = path_out;
-	process(reader, &writer, opt);
+	writer.limiter = limiter;
+	if (delta) {
+		struct stat input_info;
+		if (fstat(fileno(input.get()), &input_info) == -1)
+			throw ot::status {ot::st::standard_error, "fstat error: "s + strerror(errno)};
+		delta->path = path_in;
+		delta->file_size = input_info.st_size;
+	}
+	process(reader, &writer, opt, delta, checkpoint ? &*checkpoint : nullptr);
 	temporary_output.commit();
+	if (checkpoint)
+		remove(checkpoint->state_path.c_str());
+}
+
+/** Open a file given on the command line, where "-" means one of the standard streams. */
+static ot::file open_argument(const std::string& path, const char* mode, FILE* standard_stream)
+{
+	if (path == "-")
+		return standard_stream;
+	ot::file f = fopen(path.c_str(), mode);
+	if (f == nullptr)
+		throw ot::status {ot::st::standard_error, "Could not open '" + path + "': " + strerror(errno)};
+	return f;
+}
+
+/**
+ * Replay all the deltas of a file. An error on one file does not prevent the other ones from being
+ * processed, but a corrupted delta file stops everything.
+ */
+static void apply_deltas(const std::string& path, ot::io_limiter* limiter)
+{
+	ot::file input = open_argument(path, "re", stdin);
+	ot::status global_rc = ot::st::ok;
+	ot::header_delta delta;
+	while (ot::read_delta(input.get(), delta)) {
+		try {
+			ot::apply_delta(delta, limiter);
+		} catch (const ot::status& rc) {
+			global_rc = ot::st::error;
+			if (!rc.message.empty())
+				fprintf(stderr, "%s: error: %s\n", delta.path.c_str(), rc.message.c_str());
+		}
+	}
+	if (global_rc != ot::st::ok)
+		throw global_rc;
+}
+
+/** Write the digest of every input file into the manifest. */
+static void write_manifest(const ot::options& opt, ot::io_limiter* limiter)
+{
+	ot::file output = open_argument(*opt.manifest, "we", stdout);
+	ot::status global_rc = ot::st::ok;
+	for (const std::string& path : opt.paths_in) {
+		try {
+			ot::file input = fopen(path.c_str(), "re");
+			if (input == nullptr)
+				throw ot::status {ot::st::standard_error,
+				                  "Could not open '" + path + "' for reading: " + strerror(errno)};
+			ot::write_manifest_entry(path, ot::digest_file(input.get(), true, limiter), output.get());
+		} catch (const ot::status& rc) {
+			global_rc = ot::st::error;
+			if (!rc.message.empty())
+				fprintf(stderr, "%s: error: %s\n", path.c_str(), rc.message.c_str());
+		}
+	}
+	if (fflush(output.get()) != 0)
+		throw ot::status {ot::st::standard_error, "Could not write the manifest: "s + strerror(errno)};
+	if (global_rc != ot::st::ok)
+		throw global_rc;
+}
+
+/**
+ * Print the files of the manifest that changed, and fail if there is any. Unless check_audio is
+ * true, the files are only read up to the end of their headers.
+ */
+static void check_manifest(const std::string& path, bool check_audio, ot::io_limiter* limiter)
+{
+	ot::file manifest = open_argument(path, "re", stdin);
+	ot::status global_rc = ot::st::ok;
+	std::string file_path;
+	ot::file_digest expected;
+	while (ot::read_manifest_entry(manifest.get(), file_path, expected)) {
+		try {
+			ot::file input = fopen(file_path.c_str(), "re");
+			if (input == nullptr)
+				throw ot::status {ot::st::standard_error,
+				                  "Could not open '" + file_path + "' for reading: " + strerror(errno)};
+			ot::file_digest actual = ot::digest_file(input.get(), check_audio, limiter);
+			bool headers_changed = actual.headers != expected.headers;
+			bool audio_changed = check_audio && actual.audio != expected.audio;
+			if (headers_changed || audio_changed) {
+				global_rc = ot::st::error;
+				printf("%s: %s changed\n", file_path.c_str(),
+				       !audio_changed ? "headers" : !headers_changed ? "audio" : "headers and audio");
+			}
+		} catch (const ot::status& rc) {
+			global_rc = ot::st::error;
+			if (!rc.message.empty())
+				fprintf(stderr, "%s: error: %s\n", file_path.c_str(), rc.message.c_str());
+		}
+	}
+	if (global_rc != ot::st::ok)
+		throw global_rc;
+}
+
+/**
+ * Process count files with process, on up to jobs threads, and pass the results to report from
+ * the calling thread, in the order of the files.
+ */
+static void for_each_file(size_t count, size_t jobs,
+                          const std::function<ot::file_result(size_t)>& process,
+                          const std::function<void(ot::file_result&)>& report)
+{
+	if (jobs <= 1 || count <= 1) {
+		for (size_t i = 0; i < count; ++i) {
+			ot::file_result result = process(i);
+			report(result);
+		}
+		return;
+	}
+	ot::result_collector results(true);
+	std::atomic<size_t> next_file = 0;
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < std::min(jobs, count); ++i) {
+		workers.emplace_back([&] {
+			size_t index;
+			while ((index = next_file++) < count)
+				results.push(process(index));
+		});
+	}
+	// The workers must be joined even when reporting fails, and they do not take long to
+	// finish once no file is left.
+	auto join = [&] {
+		next_file = count;
+		for (std::thread& worker : workers)
+			worker.join();
+	};
+	try {
+		results.collect(count, report);
+	} catch (...) {
+		join();
+		throw;
+	}
+	join();
+}
+
+/** Memory budget of the tags cached by --expect. */
+static const size_t expect_cache_bytes = 64 << 20;
+
+/**
+ * Quote a string for JSON output. The tags of a file are not always valid UTF-8, so the bytes that
+ * are not part of a valid sequence are replaced with U+FFFD.
+ */
+static std::string json_quote(std::string_view text)
+{
+	std::string out = "\"";
+	for (size_t i = 0; i < text.size(); ) {
+		unsigned char c = text[i];
+		if (c >= 0x80) {
+			size_t len = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+			if (ot::is_utf8(text.substr(i, len))) {
+				out.append(text.substr(i, len));
+				i += len;
+			} else {
+				out += "\\ufffd";
+				++i;
+			}
+			continue;
+		}
+		switch (c) {
+		case '"': out += "\\\""; break;
+		case '\\': out += "\\\\"; break;
+		case '\n': out += "\\n"; break;
+		case '\r': out += "\\r"; break;
+		case '\t': out += "\\t"; break;
+		default:
+			if (c < 0x20) {
+				char escape[7];
+				snprintf(escape, sizeof(escape), "\\u%04x", c);
+				out += escape;
+			} else {
+				out += c;
+			}
+		}
+		++i;
+	}
+	out += '"';
+	return out;
+}
+
+/**
+ * Check the tags of the files listed in the expectation file, and print the differences as JSON
+ * objects, one per line. The expectations are read and checked by batches, so that the memory used
+ * does not grow with the number of files.
+ */
+static void check_expectations(const ot::options& opt, ot::io_limiter* limiter)
+{
+	ot::file input = open_argument(*opt.expect, "re", stdin);
+	json_comment_reader reader(input.get(), false);
+	struct expectation {
+		std::string path;
+		std::list<std::string> comments;
+	};
+	std::vector<expectation> batch;
+	const size_t batch_size = std::max<size_t>(1024, 64 * opt.jobs);
+	// A file listed several times is only read once, even across batches.
+	ot::header_cache cache(expect_cache_bytes, std::max<size_t>(16, opt.jobs));
+
+	auto process_file = [&](size_t index) {
+		ot::file_result result;
+		result.index = index;
+		result.path = batch[index].path;
+		try {
+			std::shared_ptr<const ot::opus_tags> tags = cache.get(result.path.c_str(), limiter);
+			result.mismatch = ot::compare_tags(batch[index].comments, tags->comments);
+		} catch (const ot::status& rc) {
+			result.rc = rc;
+		}
+		return result;
+	};
+
+	// The report is always UTF-8 JSON, so the comments are not converted to the locale.
+	ot::status global_rc = ot::st::ok;
+	auto report = [&](ot::file_result& result) {
+		if (result.rc != ot::st::ok) {
+			global_rc = ot::st::error;
+			if (!result.rc.message.empty())
+				fprintf(stderr, "%s: error: %s\n", result.path.c_str(), result.rc.message.c_str());
+			return;
+		}
+		if (!result.mismatch.empty())
+			global_rc = ot::st::error;
+		std::string path = json_quote(result.path);
+		for (const std::string& comment : result.mismatch.missing)
+			printf("{\"path\": %s, \"kind\": \"missing\", \"comment\": %s}\n",
+			       path.c_str(), json_quote(comment).c_str());
+		for (const std::string& comment : result.mismatch.unexpected)
+			printf("{\"path\": %s, \"kind\": \"unexpected\", \"comment\": %s}\n",
+			       path.c_str(), json_quote(comment).c_str());
+	};
+
+	bool more = true;
+	while (more) {
+		batch.clear();
+		while (batch.size() < batch_size) {
+			expectation& e = batch.emplace_back();
+			if (!(more = reader.next_entry(e.path, e.comments))) {
+				batch.pop_back();
+				break;
+			}
+		}
+		for_each_file(batch.size(), opt.jobs, process_file, report);
+	}
+	if (global_rc != ot::st::ok)
+		throw global_rc;
 }
 
 void ot::run(const ot::options& opt)
@@ -472,16 +1411,67 @@ void ot::run(const ot::options& opt)
 		return;
 	}
 
-	ot::status global_rc = st::ok;
-	for (const auto& path_in : opt.paths_in) {
+	if (opt.background)
+		ot::set_idle_io_priority();
+
+	// The limiter is shared by all the files so that the budget applies to the whole run.
+	std::unique_ptr<ot::io_limiter> limiter;
+	if (opt.io_bytes_per_second || opt.io_ops_per_second)
+		limiter = std::make_unique<ot::io_limiter>(opt.io_bytes_per_second, opt.io_ops_per_second);
+
+	if (opt.apply_delta) {
+		apply_deltas(*opt.apply_delta, limiter.get());
+		return;
+	}
+
+	if (opt.manifest) {
+		write_manifest(opt, limiter.get());
+		return;
+	}
+
+	if (opt.check_manifest) {
+		check_manifest(*opt.check_manifest, opt.check_audio, limiter.get());
+		return;
+	}
+
+	if (opt.expect) {
+		check_expectations(opt, limiter.get());
+		return;
+	}
+
+	ot::file delta_output;
+	if (opt.emit_delta)
+		delta_output = open_argument(*opt.emit_delta, "we", stdout);
+
+	auto process_file = [&](size_t index) {
+		ot::file_result result;
+		result.index = index;
+		result.path = opt.paths_in[index];
 		try {
-			run_single(opt, path_in, opt.in_place ? path_in : opt.path_out);
+			run_single(opt, result.path, opt.in_place ? result.path : opt.path_out,
+			           limiter.get(), delta_output ? &result.delta : nullptr);
 		} catch (const ot::status& rc) {
+			result.rc = rc;
+		}
+		return result;
+	};
+
+	// Only the main thread reports the results, so the workers never contend on the outputs.
+	ot::status global_rc = st::ok;
+	auto report = [&](ot::file_result& result) {
+		if (result.rc != st::ok) {
 			global_rc = st::error;
-			if (!rc.message.empty())
-				fprintf(stderr, "%s: error: %s\n", path_in.c_str(), rc.message.c_str());
+			if (!result.rc.message.empty())
+				fprintf(stderr, "%s: error: %s\n", result.path.c_str(), result.rc.message.c_str());
+		} else if (!result.delta.data.empty()) {
+			ot::write_delta(result.delta, delta_output.get());
 		}
-	}
+	};
+
+	for_each_file(opt.paths_in.size(), opt.jobs, process_file, report);
+
+	if (delta_output && fflush(delta_output.get()) != 0)
+		throw status {st::standard_error, "Could not write the delta file: "s + strerror(errno)};
 	if (global_rc != st::ok)
 		throw global_rc;
 }
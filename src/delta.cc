@@ -0,0 +1,184 @@
+/**
+ * \file src/delta.cc
+ * \ingroup delta
+ *
+ * Record tag edits as byte range replacements, and replay them on other copies of the files.
+ *
+ * A delta file is a sequence of records, each one made of:
+ *
+ * - the magic number "OTDelta1",
+ * - the path length on 4 bytes, followed by the path,
+ * - the original file size, the offset and the length of the original header pages, and the
+ *   checksum of the original headers, all on 8 bytes,
+ * - the page shift, on 4 bytes in two's complement,
+ * - the new pages length on 4 bytes, followed by the pages.
+ *
+ * Integers are little-endian, like in Ogg.
+ */
+
+#include <opustags.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+using namespace std::literals::string_literals;
+
+static const char delta_magic[] = "OTDelta1";
+
+static void put_integer(std::string& out, uint64_t value, int size)
+{
+	for (int i = 0; i < size; ++i) {
+		out += static_cast<char>(value & 0xFF);
+		value >>= 8;
+	}
+}
+
+void ot::write_delta(const header_delta& delta, FILE* output)
+{
+	std::string record(delta_magic, 8);
+	put_integer(record, delta.path.size(), 4);
+	record += delta.path;
+	put_integer(record, delta.file_size, 8);
+	put_integer(record, delta.offset, 8);
+	put_integer(record, delta.length, 8);
+	put_integer(record, delta.checksum, 8);
+	put_integer(record, static_cast<uint32_t>(delta.page_shift), 4);
+	put_integer(record, delta.data.size(), 4);
+	record += delta.data;
+	if (fwrite(record.data(), 1, record.size(), output) < record.size())
+		throw status {st::standard_error, "fwrite error: "s + strerror(errno)};
+}
+
+/** Read exactly size bytes, failing on a premature end of file. */
+static void read_exactly(FILE* input, void* data, size_t size)
+{
+	if (fread(data, 1, size, input) == size)
+		return;
+	if (ferror(input))
+		throw ot::status {ot::st::standard_error, "fread error: "s + strerror(errno)};
+	throw ot::status {ot::st::error, "Truncated delta file."};
+}
+
+static uint64_t get_integer(FILE* input, int size)
+{
+	unsigned char bytes[8];
+	read_exactly(input, bytes, size);
+	uint64_t value = 0;
+	for (int i = size - 1; i >= 0; --i)
+		value = (value << 8) | bytes[i];
+	return value;
+}
+
+bool ot::read_delta(FILE* input, header_delta& delta)
+{
+	char magic[8];
+	size_t len = fread(magic, 1, 8, input);
+	if (len == 0 && feof(input))
+		return false;
+	if (ferror(input))
+		throw status {st::standard_error, "fread error: "s + strerror(errno)};
+	if (len < 8 || memcmp(magic, delta_magic, 8) != 0)
+		throw status {st::bad_magic_number, "Invalid delta file."};
+
+	delta.path.resize(get_integer(input, 4));
+	read_exactly(input, delta.path.data(), delta.path.size());
+	delta.file_size = get_integer(input, 8);
+	delta.offset = get_integer(input, 8);
+	delta.length = get_integer(input, 8);
+	delta.checksum = get_integer(input, 8);
+	delta.page_shift = static_cast<int32_t>(get_integer(input, 4));
+	delta.data.resize(get_integer(input, 4));
+	read_exactly(input, delta.data.data(), delta.data.size());
+	return true;
+}
+
+/**
+ * Copy the input file to the output file, from the current position up to the end. When
+ * page_shift is not null, the pages are renumbered on the fly.
+ *
+ * The reads and writes are charged to the limiter the same way ogg_reader and ogg_writer do.
+ */
+static void copy_remaining(FILE* input, FILE* output, int32_t page_shift, ot::io_limiter* limiter)
+{
+	if (page_shift != 0) {
+		ot::ogg_reader reader(input);
+		reader.limiter = limiter;
+		ot::ogg_writer writer(output);
+		writer.limiter = limiter;
+		while (reader.next_page()) {
+			ot::renumber_page(reader.page, ogg_page_pageno(&reader.page) + page_shift);
+			writer.write_page(reader.page);
+		}
+		return;
+	}
+
+	char buffer[65536];
+	size_t len;
+	while ((len = fread(buffer, 1, sizeof(buffer), input)) > 0) {
+		if (limiter) {
+			limiter->acquire(len);
+			limiter->acquire(len);
+		}
+		if (fwrite(buffer, 1, len, output) < len)
+			throw ot::status {ot::st::standard_error, "fwrite error: "s + strerror(errno)};
+	}
+	if (ferror(input))
+		throw ot::status {ot::st::standard_error, "fread error: "s + strerror(errno)};
+}
+
+void ot::apply_delta(const header_delta& delta, io_limiter* limiter)
+{
+	ot::file input = fopen(delta.path.c_str(), "re");
+	if (input == nullptr)
+		throw status {st::standard_error,
+		              "Could not open '" + delta.path + "' for reading: " + strerror(errno)};
+
+	// Check the file is the one the delta was made from, as far as we can tell without reading
+	// the audio data.
+	struct stat input_info;
+	if (fstat(fileno(input.get()), &input_info) == -1)
+		throw status {st::standard_error, "fstat error: "s + strerror(errno)};
+	if (!S_ISREG(input_info.st_mode))
+		throw status {st::error, "Cannot apply a delta to a special file."};
+	if (static_cast<uint64_t>(input_info.st_size) != delta.file_size)
+		throw status {st::error, "The file size does not match the original file."};
+	if (delta.offset + delta.length > delta.file_size)
+		throw status {st::error, "The delta header range is out of the file."};
+	std::string header(delta.offset + delta.length, '\0');
+	if (limiter)
+		limiter->acquire(header.size());
+	read_exactly(input.get(), header.data(), header.size());
+	fnv1a_hash hash;
+	hash.update(header.data(), header.size());
+	if (hash.value != delta.checksum)
+		throw status {st::error, "The header does not match the original file."};
+
+	if (delta.data.size() == delta.length && delta.page_shift == 0) {
+		// Nothing moves, so overwriting the page is enough.
+		input.reset();
+		ot::file output = fopen(delta.path.c_str(), "r+e");
+		if (output == nullptr)
+			throw status {st::standard_error,
+			              "Could not open '" + delta.path + "' for writing: " + strerror(errno)};
+		if (fseeko(output.get(), delta.offset, SEEK_SET) == -1)
+			throw status {st::standard_error, "fseeko error: "s + strerror(errno)};
+		if (limiter)
+			limiter->acquire(delta.data.size());
+		if (fwrite(delta.data.data(), 1, delta.data.size(), output.get()) < delta.data.size())
+			throw status {st::standard_error, "fwrite error: "s + strerror(errno)};
+		if (fclose(output.release()) != 0)
+			throw status {st::standard_error, "fclose error: "s + strerror(errno)};
+		return;
+	}
+
+	partial_file output;
+	output.open(delta.path.c_str());
+	if (limiter)
+		limiter->acquire(delta.offset + delta.data.size());
+	if (fwrite(header.data(), 1, delta.offset, output.get()) < delta.offset ||
+	    fwrite(delta.data.data(), 1, delta.data.size(), output.get()) < delta.data.size())
+		throw status {st::standard_error, "fwrite error: "s + strerror(errno)};
+	copy_remaining(input.get(), output.get(), delta.page_shift, limiter);
+	output.commit();
+}
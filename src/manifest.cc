@@ -0,0 +1,178 @@
+/**
+ * \file src/manifest.cc
+ * \ingroup manifest
+ *
+ * Hash the headers and the audio of Ogg files separately.
+ *
+ * A manifest is a text file with one line per file, made of the hash of the headers and the hash of
+ * the audio, each as 16 hexadecimal digits, followed by the path, all separated by single spaces.
+ *
+ * Files may also be checked against the tags they are expected to have, with #compare_tags.
+ */
+
+#include <opustags.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+using namespace std::literals::string_literals;
+
+ot::file_digest ot::digest_file(FILE* input, bool with_audio, io_limiter* limiter)
+{
+	ot::ogg_reader reader(input);
+	reader.limiter = limiter;
+	// Ogg Skeleton streams are skipped, so that adding or removing an index changes nothing.
+	std::vector<int> skeleton_serialnos;
+	auto next_page = [&] {
+		while (reader.next_page()) {
+			int serialno = ogg_page_serialno(&reader.page);
+			if (is_skeleton_stream(reader.page))
+				skeleton_serialnos.push_back(serialno);
+			else if (std::find(skeleton_serialnos.begin(), skeleton_serialnos.end(), serialno) ==
+			         skeleton_serialnos.end())
+				return true;
+		}
+		return false;
+	};
+	if (!next_page())
+		throw status {st::error, "Expected at least 2 Ogg pages."};
+	codec format = identify_stream(reader.page);
+	if (format == codec::unknown)
+		throw status {st::error, "Not an Opus, Vorbis or FLAC stream."};
+	fnv1a_hash headers;
+	headers.update(reader.page.header, reader.page.header_len);
+	headers.update(reader.page.body, reader.page.body_len);
+
+	int serialno = ogg_page_serialno(&reader.page);
+	if (!next_page())
+		throw status {st::error, "Expected at least 2 Ogg pages."};
+	if (ogg_page_serialno(&reader.page) != serialno)
+		throw status {st::error, "Muxed streams are not supported yet."};
+	std::string raw_pages;
+	size_t count = 0;
+	reader.read_header_packets([&](ogg_packet& p) {
+		return !is_last_header_packet(format, p, ++count);
+	}, &raw_pages);
+	headers.update(raw_pages.data(), raw_pages.size());
+
+	file_digest digest;
+	digest.headers = headers.value;
+	if (!with_audio)
+		return digest;
+
+	// Skip the page sequence number and the CRC, in bytes 18 to 25 of the page header.
+	fnv1a_hash audio;
+	while (next_page()) {
+		if (ogg_page_serialno(&reader.page) != serialno)
+			throw status {st::error, "Muxed streams are not supported yet."};
+		audio.update(reader.page.header, 18);
+		audio.update(reader.page.header + 26, reader.page.header_len - 26);
+		audio.update(reader.page.body, reader.page.body_len);
+	}
+	digest.audio = audio.value;
+	return digest;
+}
+
+void ot::write_manifest_entry(const std::string& path, const file_digest& digest, FILE* output)
+{
+	if (path.find('\n') != std::string::npos)
+		throw status {st::error, "Cannot record a path containing a line break in a manifest."};
+	if (fprintf(output, "%016" PRIx64 " %016" PRIx64 " %s\n",
+	            digest.headers, digest.audio, path.c_str()) < 0)
+		throw status {st::standard_error, "fprintf error: "s + strerror(errno)};
+}
+
+/** Parse exactly 16 hexadecimal digits. */
+static bool parse_hash(std::string_view digits, uint64_t& value)
+{
+	value = 0;
+	for (char c : digits) {
+		int digit;
+		if (c >= '0' && c <= '9')
+			digit = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			digit = c - 'a' + 10;
+		else
+			return false;
+		value = value << 4 | digit;
+	}
+	return digits.size() == 16;
+}
+
+bool ot::read_manifest_entry(FILE* input, std::string& path, file_digest& digest)
+{
+	char* line = nullptr;
+	size_t buflen = 0;
+	ssize_t nread = getline(&line, &buflen, input);
+	std::string entry(line ? line : "", nread > 0 ? nread : 0);
+	free(line);
+	if (nread == -1) {
+		if (ferror(input))
+			throw status {st::standard_error, "getline error: "s + strerror(errno)};
+		return false;
+	}
+	if (!entry.empty() && entry.back() == '\n')
+		entry.pop_back();
+
+	std::string_view view = entry;
+	if (view.size() <= 34 || view[16] != ' ' || view[33] != ' ' ||
+	    !parse_hash(view.substr(0, 16), digest.headers) ||
+	    !parse_hash(view.substr(17, 16), digest.audio))
+		throw status {st::error, "Invalid manifest line: " + entry};
+	path = entry.substr(34);
+	return true;
+}
+
+/**
+ * Key on which comments are compared: the field name in upper case, followed by the value as is.
+ * Field names are ASCII, so converting them byte by byte is enough.
+ */
+static std::string comparison_key(const std::string& comment)
+{
+	std::string key = comment;
+	size_t equal = std::min(key.find('='), key.size());
+	std::transform(key.begin(), key.begin() + equal, key.begin(),
+	               [](unsigned char c) { return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c; });
+	return key;
+}
+
+ot::tag_mismatch ot::compare_tags(const std::list<std::string>& expected, const std::list<std::string>& actual)
+{
+	using keyed = std::pair<std::string, const std::string*>;
+	std::vector<keyed> want, have;
+	std::vector<std::string> fields;
+	want.reserve(expected.size());
+	for (const std::string& comment : expected) {
+		want.emplace_back(comparison_key(comment), &comment);
+		fields.push_back(want.back().first.substr(0, want.back().first.find('=') + 1));
+	}
+	std::sort(fields.begin(), fields.end());
+	for (const std::string& comment : actual) {
+		std::string key = comparison_key(comment);
+		auto field = std::upper_bound(fields.begin(), fields.end(), key);
+		if (field != fields.begin() && key.compare(0, (field - 1)->size(), *(field - 1)) == 0)
+			have.emplace_back(std::move(key), &comment);
+	}
+	auto by_key = [](const keyed& a, const keyed& b) { return a.first < b.first; };
+	std::sort(want.begin(), want.end(), by_key);
+	std::sort(have.begin(), have.end(), by_key);
+
+	// Walk both sorted lists together, like std::set_difference in both directions at once.
+	tag_mismatch mismatch;
+	auto w = want.begin(), h = have.begin();
+	while (w != want.end() || h != have.end()) {
+		if (h == have.end() || (w != want.end() && w->first < h->first)) {
+			mismatch.missing.push_back(*(w++)->second);
+		} else if (w == want.end() || h->first < w->first) {
+			mismatch.unexpected.push_back(*(h++)->second);
+		} else {
+			++w;
+			++h;
+		}
+	}
+	return mismatch;
+}
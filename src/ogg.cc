@@ -15,18 +15,43 @@
 
 using namespace std::literals::string_literals;
 
-bool ot::is_opus_stream(const ogg_page& identification_header)
+ot::codec ot::identify_stream(const ogg_page& identification_header)
 {
 	if (ogg_page_bos(&identification_header) == 0)
-		return false;
-	if (identification_header.body_len < 8)
-		return false;
-	return (memcmp(identification_header.body, "OpusHead", 8) == 0);
+		return codec::unknown;
+	auto has_signature = [&](const char* signature, long size) {
+		return identification_header.body_len >= size &&
+		       memcmp(identification_header.body, signature, size) == 0;
+	};
+	if (has_signature("OpusHead", 8))
+		return codec::opus;
+	if (has_signature("\x01vorbis", 7))
+		return codec::vorbis;
+	if (has_signature("\x7F" "FLAC", 5))
+		return codec::flac;
+	return codec::unknown;
+}
+
+bool ot::is_opus_stream(const ogg_page& identification_header)
+{
+	return identify_stream(identification_header) == codec::opus;
+}
+
+void ot::renumber_page(ogg_page& page, long pageno)
+{
+	uint32_t n = pageno;
+	for (int i = 18; i < 22; ++i) {
+		page.header[i] = n & 0xFF;
+		n >>= 8;
+	}
+	ogg_page_checksum_set(&page);
 }
 
 bool ot::ogg_reader::next_page()
 {
 	int rc;
+	if (absolute_page_no != (size_t) -1)
+		page_offset += page.header_len + page.body_len;
 	while ((rc = ogg_sync_pageout(&sync, &page)) != 1) {
 		if (rc == -1) {
 			throw status {st::bad_stream,
@@ -46,6 +71,10 @@ bool ot::ogg_reader::next_page()
 		size_t len = fread(buf, 1, 65536, file);
 		if (ferror(file))
 			throw status {st::standard_error, "fread error: "s + strerror(errno)};
+		// Charge what was actually read, so that short reads and the final empty read at the
+		// end of the file only cost an operation.
+		if (limiter)
+			limiter->acquire(len);
 		if (ogg_sync_wrote(&sync, len) != 0)
 			throw status {st::libogg_error, "ogg_sync_wrote failed."};
 	}
@@ -82,12 +111,64 @@ void ot::ogg_reader::process_header_packet(const std::function<void(ogg_packet&)
 		throw status {ot::st::error, "Header page contains more than a single packet."};
 }
 
+void ot::ogg_reader::read_header_packets(const std::function<bool(ogg_packet&)>& f,
+                                         std::string* raw_pages)
+{
+	if (ogg_page_continued(&page))
+		throw status {ot::st::error, "Unexpected continued header page."};
+	int serialno = ogg_page_serialno(&page);
+	ogg_logical_stream stream(serialno);
+	stream.pageno = ogg_page_pageno(&page);
+	bool more = true;
+	for (;;) {
+		if (raw_pages) {
+			raw_pages->append(reinterpret_cast<char*>(page.header), page.header_len);
+			raw_pages->append(reinterpret_cast<char*>(page.body), page.body_len);
+		}
+		if (ogg_stream_pagein(&stream, &page) != 0)
+			throw status {st::libogg_error, "ogg_stream_pagein failed."};
+
+		ogg_packet packet;
+		int rc = 0;
+		while (more && (rc = ogg_stream_packetout(&stream, &packet)) == 1)
+			more = f(packet);
+		if (ogg_stream_check(&stream) != 0 || rc == -1)
+			throw status {ot::st::libogg_error, "ogg_stream_packetout failed."};
+
+		// Make sure the last packet completed the page. See process_header_packet.
+		if (!more) {
+			if (stream.lacing_returned != stream.lacing_fill)
+				throw status {ot::st::error, "The last header packet does not complete its page."};
+			return;
+		}
+
+		if (!next_page())
+			throw status {ot::st::error, "Unexpected end of stream in the headers."};
+		if (ogg_page_serialno(&page) != serialno)
+			throw status {ot::st::error, "Muxed streams are not supported yet."};
+	}
+}
+
+void ot::ogg_reader::seek(uint64_t offset)
+{
+	if (fseeko(file, offset, SEEK_SET) == -1)
+		throw status {st::standard_error, "fseeko error: "s + strerror(errno)};
+	if (ogg_sync_reset(&sync) != 0)
+		throw status {st::libogg_error, "ogg_sync_reset failed."};
+	page_offset = offset;
+	// Prevent next_page from moving the offset past the previous page.
+	page.header_len = 0;
+	page.body_len = 0;
+}
+
 void ot::ogg_writer::write_page(const ogg_page& page)
 {
 	if (page.header_len < 0 || page.body_len < 0)
 		throw status {st::int_overflow, "Overflowing page length"};
 	auto header_len = static_cast<size_t>(page.header_len);
 	auto body_len = static_cast<size_t>(page.body_len);
+	if (limiter)
+		limiter->acquire(header_len + body_len);
 	if (fwrite(page.header, 1, header_len, file) < header_len)
 		throw status {st::standard_error, "fwrite error: "s + strerror(errno)};
 	if (fwrite(page.body, 1, body_len, file) < body_len)
@@ -116,3 +197,32 @@ void ot::ogg_writer::write_header_packet(int serialno, int pageno, ogg_packet& p
 	if (ogg_stream_check(&stream) != 0)
 		throw status {st::libogg_error, "ogg_stream_check failed"};
 }
+
+size_t ot::ogg_writer::write_header_packets(int serialno, int pageno, std::vector<dynamic_ogg_packet>& packets,
+                                            std::string* page_data)
+{
+	ogg_logical_stream stream(serialno);
+	stream.b_o_s = (pageno != 0);
+	stream.pageno = pageno;
+	for (ogg_packet& packet : packets) {
+		if (ogg_stream_packetin(&stream, &packet) != 0)
+			throw status {ot::st::libogg_error, "ogg_stream_packetin failed"};
+	}
+
+	if (page_data)
+		page_data->clear();
+	size_t page_count = 0;
+	ogg_page page;
+	while (ogg_stream_flush(&stream, &page) != 0) {
+		write_page(page);
+		++page_count;
+		if (page_data) {
+			page_data->append(reinterpret_cast<char*>(page.header), page.header_len);
+			page_data->append(reinterpret_cast<char*>(page.body), page.body_len);
+		}
+	}
+
+	if (ogg_stream_check(&stream) != 0)
+		throw status {st::libogg_error, "ogg_stream_check failed"};
+	return page_count;
+}
@@ -16,6 +16,12 @@
  * OpusTags is similar to [Vorbis Comment](https://www.xiph.org/vorbis/doc/v-comment.html), which
  * gives us some context, but let's stick to the RFC for the technical details.
  *
+ * The same comment structure is used by Ogg Vorbis and Ogg FLAC, with a different framing:
+ *
+ * - Vorbis prefixes it with \x03vorbis, and appends a framing bit, which we keep in the extra data.
+ * - FLAC wraps it in a VORBIS_COMMENT metadata block, whose 4-byte header contains the block type
+ *   and length. See the [Ogg FLAC mapping](https://xiph.org/flac/ogg_mapping.html).
+ *
  * \todo Validate that the vendor string and comments are valid UTF-8.
  * \todo Validate that field names are ASCII: 0x20 through 0x7D, 0x3D ('=') excluded.
  *
@@ -39,7 +45,13 @@
 #define le32toh(x) OSSwapLittleToHostInt32(x)
 #endif
 
-ot::opus_tags ot::parse_tags(const ogg_packet& packet)
+/** The FLAC metadata block type of the Vorbis comments. */
+static constexpr unsigned char flac_vorbis_comment = 4;
+
+/** The flag in the first byte of a FLAC metadata block header marking the last block. */
+static constexpr unsigned char flac_last_block = 0x80;
+
+ot::opus_tags ot::parse_tags(const ogg_packet& packet, codec format)
 {
 	if (packet.bytes < 0)
 		throw status {st::int_overflow, "Overflowing comment header length"};
@@ -47,15 +59,37 @@ ot::opus_tags ot::parse_tags(const ogg_packet& packet)
 	const char* data = reinterpret_cast<char*>(packet.packet);
 	size_t pos = 0;
 	opus_tags my_tags;
+	my_tags.codec = format;
 
 	// Magic number
-	if (8 > size)
-		throw status {st::cut_magic_number, "Comment header too short for the magic number"};
-	if (memcmp(data, "OpusTags", 8) != 0)
-		throw status {st::bad_magic_number, "Comment header did not start with OpusTags"};
+	if (format == codec::opus) {
+		if (8 > size)
+			throw status {st::cut_magic_number, "Comment header too short for the magic number"};
+		if (memcmp(data, "OpusTags", 8) != 0)
+			throw status {st::bad_magic_number, "Comment header did not start with OpusTags"};
+		pos = 8;
+	} else if (format == codec::vorbis) {
+		if (7 > size)
+			throw status {st::cut_magic_number, "Comment header too short for the magic number"};
+		if (memcmp(data, "\x03vorbis", 7) != 0)
+			throw status {st::bad_magic_number, "Comment header did not start with \\x03vorbis"};
+		pos = 7;
+	} else if (format == codec::flac) {
+		if (4 > size)
+			throw status {st::cut_magic_number, "Comment header too short for the metadata block header"};
+		auto header = reinterpret_cast<const unsigned char*>(data);
+		if ((header[0] & ~flac_last_block) != flac_vorbis_comment)
+			throw status {st::bad_magic_number, "Comment header is not a VORBIS_COMMENT metadata block"};
+		my_tags.last_metadata_block = header[0] & flac_last_block;
+		size_t block_length = header[1] << 16 | header[2] << 8 | header[3];
+		if (4 + block_length != size)
+			throw status {st::bad_magic_number, "FLAC metadata block length does not match the packet"};
+		pos = 4;
+	} else {
+		throw status {st::error, "Unsupported codec"};
+	}
 
 	// Vendor
-	pos = 8;
 	if (pos + 4 > size)
 		throw status {st::cut_vendor_length,
 		        "Vendor string length did not fit the comment header"};
@@ -93,7 +127,17 @@ ot::opus_tags ot::parse_tags(const ogg_packet& packet)
 
 ot::dynamic_ogg_packet ot::render_tags(const opus_tags& tags)
 {
-	size_t size = 8 + 4 + tags.vendor.size() + 4;
+	std::string_view magic;
+	if (tags.codec == codec::opus)
+		magic = "OpusTags";
+	else if (tags.codec == codec::vorbis)
+		magic = "\x03vorbis";
+	else if (tags.codec == codec::flac)
+		magic = std::string_view("\0\0\0\0", 4); // the metadata block header, filled below
+	else
+		throw status {st::error, "Unsupported codec"};
+
+	size_t size = magic.size() + 4 + tags.vendor.size() + 4;
 	for (const std::string& comment : tags.comments)
 		size += 4 + comment.size();
 	size += tags.extra_data.size();
@@ -106,11 +150,21 @@ ot::dynamic_ogg_packet ot::render_tags(const opus_tags& tags)
 
 	unsigned char* data = op.packet;
 	uint32_t n;
-	memcpy(data, "OpusTags", 8);
+	memcpy(data, magic.data(), magic.size());
+	if (tags.codec == codec::flac) {
+		size_t block_length = size - 4;
+		if (block_length >= 1 << 24)
+			throw status {st::int_overflow, "Comments are too large for a FLAC metadata block"};
+		data[0] = flac_vorbis_comment | (tags.last_metadata_block ? flac_last_block : 0);
+		data[1] = block_length >> 16;
+		data[2] = block_length >> 8;
+		data[3] = block_length;
+	}
+	data += magic.size();
 	n = htole32(tags.vendor.size());
-	memcpy(data+8, &n, 4);
-	memcpy(data+12, tags.vendor.data(), tags.vendor.size());
-	data += 12 + tags.vendor.size();
+	memcpy(data, &n, 4);
+	memcpy(data+4, tags.vendor.data(), tags.vendor.size());
+	data += 4 + tags.vendor.size();
 	n = htole32(tags.comments.size());
 	memcpy(data, &n, 4);
 	data += 4;
@@ -124,3 +178,46 @@ ot::dynamic_ogg_packet ot::render_tags(const opus_tags& tags)
 
 	return op;
 }
+
+bool ot::is_last_header_packet(codec format, const ogg_packet& packet, size_t index)
+{
+	if (format == codec::opus)
+		return index >= 1;
+	else if (format == codec::vorbis)
+		return index >= 2;
+	else if (format == codec::flac)
+		return packet.bytes == 0 || (packet.packet[0] & flac_last_block);
+	else
+		throw status {st::error, "Unsupported codec"};
+}
+
+ot::opus_tags ot::read_tags(FILE* input, io_limiter* limiter)
+{
+	ot::ogg_reader reader(input);
+	reader.limiter = limiter;
+	std::optional<int> skeleton_serialno;
+	auto next_page = [&] {
+		do {
+			if (!reader.next_page())
+				throw status {st::error, "Expected at least 2 Ogg pages."};
+			if (is_skeleton_stream(reader.page))
+				skeleton_serialno = ogg_page_serialno(&reader.page);
+		} while (skeleton_serialno == ogg_page_serialno(&reader.page));
+	};
+	next_page();
+	codec format = identify_stream(reader.page);
+	if (format == codec::unknown)
+		throw status {st::error, "Not an Opus, Vorbis or FLAC stream."};
+	int serialno = ogg_page_serialno(&reader.page);
+	next_page();
+	if (ogg_page_serialno(&reader.page) != serialno)
+		throw status {st::error, "Muxed streams are not supported yet."};
+	opus_tags tags;
+	size_t count = 0;
+	reader.read_header_packets([&](ogg_packet& p) {
+		if (count++ == 0)
+			tags = parse_tags(p, format);
+		return !is_last_header_packet(format, p, count);
+	});
+	return tags;
+}
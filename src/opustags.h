@@ -7,7 +7,14 @@
  *
  * - The system module provides a few generic tools for interating with the system.
  * - The ogg module reads and writes Ogg files, letting you manipulate Ogg pages and packets.
- * - The opus module parses the contents of Ogg packets according to the Opus specifications.
+ * - The opus module parses the contents of Ogg packets according to the Opus specifications, and
+ *   to the Vorbis and FLAC ones, which share the same comment format.
+ * - The skeleton module writes Ogg Skeleton streams indexing the audio for fast seeking.
+ * - The delta module records and replays header edits, to replicate them without copying files.
+ * - The manifest module hashes the headers and the audio separately, to detect changes quickly.
+ * - The resume module saves the progress of long rewrites, to resume them after an interruption.
+ * - The cache module keeps parsed headers in memory, for long-running processes.
+ * - The parallel module brings the results of the worker threads back to the main thread.
  * - The cli module implements the main logic of the program.
  * - The opustags module contains the main function, which is a simple wrapper around cli.
  *
@@ -29,14 +36,20 @@
 #include <iconv.h>
 #include <ogg/ogg.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
 #include <time.h>
 
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <unordered_map>
 #include <vector>
 
 namespace ot {
@@ -121,10 +134,19 @@ public:
 	 * final move operation instant.
 	 */
 	void open(const char* destination);
+	/**
+	 * Open the partial file of a resumable rewrite. It is named after the destination with a
+	 * .part suffix, so that a later attempt finds it again. When resume is true and the partial
+	 * file exists, its content is preserved and true is returned. Otherwise, it is created
+	 * empty. The file is opened for both reading and writing.
+	 */
+	bool open_resumable(const char* destination, bool resume);
 	/** Close then move the partial file to its final location. */
 	void commit();
-	/** Delete the temporary file. */
+	/** Delete the temporary file, unless #keep was called. */
 	void abort();
+	/** Keep the temporary file on #abort, so that a resumable rewrite can continue it later. */
+	void keep(bool enable = true) { kept = enable; }
 	/** Get the underlying FILE* handle. */
 	FILE* get() { return file.get(); }
 	/** Get the name of the temporary file. */
@@ -133,6 +155,7 @@ private:
 	std::string temporary_name;
 	std::string final_name;
 	ot::file file;
+	bool kept = false;
 };
 
 /** C++ wrapper for iconv. */
@@ -143,6 +166,9 @@ public:
 	 * character encodings. If it's okay to have some information lost, make sure `to` ends with
 	 * "//TRANSLIT", otherwise the conversion will fail when a character cannot be represented
 	 * in the target encoding. See the documentation of iconv_open for details.
+	 *
+	 * When both encodings are UTF-8, which is the common case of converting from or to a UTF-8
+	 * locale, iconv is bypassed and the text is only validated.
 	 */
 	encoding_converter(const char* from, const char* to);
 	~encoding_converter();
@@ -153,8 +179,15 @@ public:
 	std::string operator()(std::string_view in);
 private:
 	iconv_t cd; /**< conversion descriptor */
+	bool passthrough = false; /**< both encodings are UTF-8 */
 };
 
+/**
+ * Check if a string is valid UTF-8, rejecting overlong forms, surrogates, and code points beyond
+ * U+10FFFF like iconv does.
+ */
+bool is_utf8(std::string_view text);
+
 /** Escape a string so that a POSIX shell interprets it as a single argument. */
 std::string shell_escape(std::string_view word);
 
@@ -173,6 +206,85 @@ void run_editor(std::string_view editor, std::string_view path);
  */
 timespec get_file_timestamp(const char* path);
 
+/**
+ * What the file system tells about a file without reading it. If the identity of a file did not
+ * change, its content most likely did not either.
+ */
+struct file_identity {
+	dev_t device;
+	ino_t inode;
+	off_t size;
+	timespec mtime; /**< same as #get_file_timestamp */
+	bool operator==(const file_identity& other) const {
+		return device == other.device && inode == other.inode && size == other.size &&
+		       mtime.tv_sec == other.mtime.tv_sec && mtime.tv_nsec == other.mtime.tv_nsec;
+	}
+};
+
+/** Identify the file at the given path, with a single stat call. */
+file_identity get_file_identity(const char* path);
+
+/** Identify an opened file. */
+file_identity get_file_identity(FILE* file);
+
+/**
+ * Incremental 64-bit FNV-1a hash, used to detect accidental changes in files. It is fast and
+ * simple, but offers no protection against malicious changes.
+ */
+struct fnv1a_hash {
+	/** Hash more data. */
+	void update(const void* data, size_t size);
+	/** Hash of the data passed so far. */
+	uint64_t value = 0xcbf29ce484222325;
+};
+
+/**
+ * Put the current process in the idle I/O scheduling class, so that its disk accesses are only
+ * served when no other process needs the disk. This is only supported on Linux.
+ */
+void set_idle_io_priority();
+
+/**
+ * Token bucket limiting the I/O throughput, both in bytes and in operations per second.
+ *
+ * The bucket starts full and holds at most one second worth of budget. When an operation exceeds
+ * the budget, the bucket goes into debt and the caller sleeps until the debt is paid back. A
+ * single limiter may be shared by several readers and writers, including across threads.
+ */
+class io_limiter {
+public:
+	/** A rate of 0 disables the corresponding limit. */
+	io_limiter(uint64_t bytes_per_second, uint64_t ops_per_second);
+	/** Account for an operation transferring the given amount of bytes, and wait if needed. */
+	void acquire(size_t bytes);
+private:
+	using clock = std::chrono::steady_clock;
+	uint64_t bytes_per_second;
+	uint64_t ops_per_second;
+	double byte_tokens; /**< may be negative when in debt */
+	double op_tokens; /**< may be negative when in debt */
+	clock::time_point last_refill;
+	std::mutex mutex;
+};
+
+/** Default size of the chunks copied by each thread of #copy_range. */
+constexpr uint64_t copy_chunk_size = 16 << 20;
+
+/**
+ * Copy length bytes from the input file descriptor at input_offset to the output file descriptor
+ * at output_offset, on up to the given number of threads. The file offsets of the descriptors are
+ * left untouched.
+ *
+ * The range is split into chunks aligned on chunk_size in the output, so that each thread writes
+ * whole stripes of striped storage, and the threads take the next chunk left whenever they are
+ * done with one. The data is copied with copy_file_range when the system supports it, letting
+ * the kernel or the file system skip the copy through user space, and with pread and pwrite
+ * otherwise. Either way, the limiter is charged for both the read and the write.
+ */
+void copy_range(int input, uint64_t input_offset, int output, uint64_t output_offset,
+                uint64_t length, size_t threads, io_limiter* limiter = nullptr,
+                uint64_t chunk_size = copy_chunk_size);
+
 /** \} */
 
 /***********************************************************************************************//**
@@ -195,13 +307,32 @@ struct ogg_logical_stream : ogg_stream_state {
 	}
 };
 
+/**
+ * Codecs whose comment header opustags can edit.
+ */
+enum class codec {
+	unknown,
+	opus,
+	vorbis,
+	flac,
+};
+
 /**
  * Identify the codec of a logical stream based on the first bytes of the first packet of the first
- * page. For Opus, the first 8 bytes must be OpusHead. Any other signature is assumed to be another
- * codec.
+ * page. The signatures are OpusHead for Opus, \x01vorbis for Vorbis, and \x7FFLAC for FLAC.
+ */
+codec identify_stream(const ogg_page& identification_header);
+
+/**
+ * Check whether the page is the beginning of an Opus stream. See #identify_stream.
  */
 bool is_opus_stream(const ogg_page& identification_header);
 
+/**
+ * Change the sequence number of a page in place, and update its checksum accordingly.
+ */
+void renumber_page(ogg_page& page, long pageno);
+
 /**
  * Ogg reader, combining a FILE input, an ogg_sync_state reading the pages.
  *
@@ -237,6 +368,24 @@ struct ogg_reader {
 	 * extended to support packets spanning multiple pages.
 	 */
 	void process_header_packet(const std::function<void(ogg_packet&)>& f);
+	/**
+	 * Read a sequence of header packets, starting from the last page read, and call f on each
+	 * of them, until f returns false. The packets may span several pages, and a page may hold
+	 * several packets, but the last packet must complete its page, as required by all the
+	 * codecs we support. After the call, #page is the last page of the headers.
+	 *
+	 * The packets are only valid during the call to f.
+	 *
+	 * When raw_pages is not null, the raw content of all the pages read is appended to it.
+	 */
+	void read_header_packets(const std::function<bool(ogg_packet&)>& f,
+	                         std::string* raw_pages = nullptr);
+	/**
+	 * Continue reading from the given offset in the file, which must be the beginning of a page.
+	 * The next call to #next_page reads that page, but #absolute_page_no does not count the
+	 * pages skipped.
+	 */
+	void seek(uint64_t offset);
 	/**
 	 * Current page from the sync state.
 	 *
@@ -250,6 +399,12 @@ struct ogg_reader {
 	 * (size_t) -1.
 	 */
 	size_t absolute_page_no = -1;
+	/**
+	 * Byte offset of the last read page in the input file. Since the reader fails on unsynced
+	 * data, the pages are contiguous and the offset is simply the sum of the sizes of the
+	 * previous pages.
+	 */
+	uint64_t page_offset = 0;
 	/**
 	 * The file is our source of binary data. It is not integrated to libogg, so we need to
 	 * handle it ourselves.
@@ -257,6 +412,11 @@ struct ogg_reader {
 	 * The file is not owned by the ogg_reader instance.
 	 */
 	FILE* file;
+	/**
+	 * Optional I/O budget to comply with when reading the file. It is not owned by the reader,
+	 * and may be shared with other readers and writers.
+	 */
+	io_limiter* limiter = nullptr;
 	/**
 	 * The sync layer gets binary data and yields a sequence of pages.
 	 *
@@ -267,6 +427,8 @@ struct ogg_reader {
 	ogg_sync_state sync;
 };
 
+struct dynamic_ogg_packet;
+
 /**
  * An Ogg writer lets you write ogg_page objets to an output file, and assemble packets into pages.
  *
@@ -290,6 +452,15 @@ struct ogg_writer {
 	 * pages.
 	 */
 	void write_header_packet(int serialno, int pageno, ogg_packet& packet);
+	/**
+	 * Write a sequence of header packets, on as many pages as needed, starting with page number
+	 * pageno. The last page is flushed right after the last packet.
+	 *
+	 * Return the number of pages written. When page_data is not null, a copy of all the raw
+	 * pages written is stored in it.
+	 */
+	size_t write_header_packets(int serialno, int pageno, std::vector<dynamic_ogg_packet>& packets,
+	                            std::string* page_data = nullptr);
 	/**
 	 * Output file. It should be opened in binary mode. We use it to write whole pages,
 	 * represented as a block of data and a length.
@@ -299,6 +470,11 @@ struct ogg_writer {
 	 * Path to the output file.
 	 */
 	std::optional<std::string> path;
+	/**
+	 * Optional I/O budget to comply with when writing pages. It is not owned by the writer,
+	 * and may be shared with other readers and writers.
+	 */
+	io_limiter* limiter = nullptr;
 };
 
 /**
@@ -313,6 +489,12 @@ struct dynamic_ogg_packet : ogg_packet {
 		data = std::make_unique<unsigned char[]>(size);
 		packet = data.get();
 	}
+	/** Copy a packet, including its data. */
+	explicit dynamic_ogg_packet(const ogg_packet& source) : ogg_packet(source) {
+		data = std::make_unique<unsigned char[]>(bytes);
+		memcpy(data.get(), source.packet, bytes);
+		packet = data.get();
+	}
 private:
 	/** Owning reference to the data. Use the packet field from ogg_packet instead. */
 	std::unique_ptr<unsigned char[]> data;
@@ -331,8 +513,16 @@ private:
  *
  * The vendor and comment strings are expected to contain valid UTF-8, but we should keep their
  * values intact even if the string is not UTF-8 clean, or encoded in any other way.
+ *
+ * Vorbis and FLAC comment headers share the same structure, so they are represented by the same
+ * type. Only their framing differs.
  */
 struct opus_tags {
+	/**
+	 * Codec whose comment header the tags were read from, and defining how they will be
+	 * rendered.
+	 */
+	ot::codec codec = ot::codec::opus;
 	/**
 	 * OpusTags packets begin with a vendor string, meant to identify the implementation of the
 	 * encoder. It is expected to be an arbitrary UTF-8 string.
@@ -357,20 +547,403 @@ struct opus_tags {
 	 *
 	 * In the future, we could add options to manipulate this data: view it, edit it, truncate
 	 * it if it's marked as padding, truncate it unconditionally.
+	 *
+	 * For Vorbis, it contains the framing bit.
 	 */
 	std::string extra_data;
+	/**
+	 * For FLAC, whether the comment metadata block is the last one, i.e. directly followed by
+	 * the audio data.
+	 */
+	bool last_metadata_block = false;
 };
 
 /**
- * Read the given OpusTags packet and extract its content into an opus_tags object.
+ * Read the given comment header packet and extract its content into an opus_tags object. For Opus,
+ * this is the OpusTags packet.
  */
-opus_tags parse_tags(const ogg_packet& packet);
+opus_tags parse_tags(const ogg_packet& packet, codec format = codec::opus);
 
 /**
- * Serialize an #opus_tags object into an OpusTags Ogg packet.
+ * Serialize an #opus_tags object into a comment header packet, according to its codec.
  */
 dynamic_ogg_packet render_tags(const opus_tags& tags);
 
+/**
+ * Check whether a header packet is the last one before the audio data. The packets are numbered
+ * from the comment header, whose index is 1.
+ *
+ * Opus has only the comment header, Vorbis has the comment and setup headers, and FLAC has any
+ * number of metadata blocks, the last one being flagged as such.
+ */
+bool is_last_header_packet(codec format, const ogg_packet& packet, size_t index);
+
+/**
+ * Read the tags of an Ogg file like opustags does in read-only mode, stopping at the end of the
+ * header pages. Ogg Skeleton streams are skipped. When limiter is not null, the reads are charged
+ * to it.
+ */
+opus_tags read_tags(FILE* input, io_limiter* limiter = nullptr);
+
+/** \} */
+
+/***********************************************************************************************//**
+ * \defgroup skeleton Skeleton
+ * \{
+ */
+
+/**
+ * Check if an Ogg page is the beginning of an Ogg Skeleton stream, starting with a fishead packet.
+ */
+bool is_skeleton_stream(const ogg_page& page);
+
+/**
+ * Ogg Skeleton 4.0 stream describing and indexing another logical stream, so that players can seek
+ * with a single read instead of bisecting the file.
+ *
+ * The Skeleton headers come before any audio page, but the index is only known once all the audio
+ * pages are written. The headers are therefore first written with room for the largest index
+ * possible, then rewritten in place with the final values, which requires a seekable output.
+ *
+ * A keypoint is recorded every #keypoint_spacing bytes of audio, which bounds their number by the
+ * size of the input.
+ */
+class skeleton_index {
+public:
+	/**
+	 * Describe the stream identified by its first packet. input_size is the size of the file
+	 * it is read from, and must be known to reserve the space of the index.
+	 *
+	 * The Skeleton stream uses the serial number following the indexed stream's, wrapping around
+	 * like the unsigned 32-bit serial numbers of Ogg.
+	 */
+	skeleton_index(int serialno, codec format, const ogg_packet& identification, uint64_t input_size);
+	/** Write the fishead page, which must be the very first page of the output. */
+	void write_head(ogg_writer& writer);
+	/**
+	 * Write the fisbone and index packets, and the end of the Skeleton stream. The header pages
+	 * of the indexed stream must have been written, and header_count is their number of
+	 * packets, identification header included.
+	 */
+	void write_headers(ogg_writer& writer, size_t header_count);
+	/** Account for a page of the indexed stream written after the headers. */
+	void add_page(const ogg_page& page);
+	/** Rewrite the Skeleton headers with the final index, once all the pages are written. */
+	void finish(ogg_writer& writer);
+
+	/** Minimum number of bytes between two keypoints. */
+	static constexpr uint64_t keypoint_spacing = 64 << 10;
+private:
+	struct keypoint {
+		uint64_t offset;
+		int64_t time;
+	};
+	dynamic_ogg_packet render_head() const;
+	dynamic_ogg_packet render_bone() const;
+	dynamic_ogg_packet render_index() const;
+	/** Convert a granule position of the indexed stream to milliseconds. */
+	int64_t granule_time(int64_t granulepos) const;
+
+	int serialno;
+	int indexed_serialno;
+	codec format;
+	int64_t granule_rate = 0;
+	int64_t base_granule = 0;
+	uint32_t preroll = 0;
+	uint32_t header_count = 0;
+	/** Size of the index packet, padded to fit the largest index possible. */
+	size_t index_size;
+	/** Offsets of the Skeleton pages to rewrite, and of the first audio page. */
+	uint64_t head_offset = 0;
+	uint64_t headers_offset = 0;
+	uint64_t content_offset = 0;
+	/** Offset of the next page of the indexed stream. */
+	uint64_t next_offset = 0;
+	/** Last granule position seen, which is the start time of the next page. */
+	int64_t last_granule;
+	std::vector<keypoint> keypoints;
+};
+
+/** \} */
+
+/***********************************************************************************************//**
+ * \defgroup delta Delta
+ * \{
+ */
+
+/**
+ * Description of a tag edit on a file, sufficient to reproduce the edit on an identical copy of
+ * the original file without transferring the audio data.
+ *
+ * Editing tags only changes the header pages following the identification header. The edit is the
+ * replacement of that byte range by another one of a possibly different size. When the number of
+ * header pages changes, the pages that follow must also be renumbered, but that does not require
+ * any data besides the difference of page count.
+ */
+struct header_delta {
+	/** Path to the edited file, as given on the command line. */
+	std::string path;
+	/** Size of the original file. */
+	uint64_t file_size;
+	/** Offset of the original comment header page. */
+	uint64_t offset;
+	/** Size of the original header pages, from the comment header. */
+	uint64_t length;
+	/** #fnv1a_hash of the original file from its beginning up to the end of the headers. */
+	uint64_t checksum;
+	/** Number of header pages added, or removed if negative, by the edit. */
+	int32_t page_shift = 0;
+	/** Raw content of the new header pages. */
+	std::string data;
+};
+
+/**
+ * Append a delta to a delta file.
+ */
+void write_delta(const header_delta& delta, FILE* output);
+
+/**
+ * Read the next delta from a file written by #write_delta. Return false at the end of the file.
+ */
+bool read_delta(FILE* input, header_delta& delta);
+
+/**
+ * Replay the delta on the file at its path, after checking that the file matches the original
+ * one.
+ *
+ * When the headers keep the same size, the new pages are written in place. Otherwise, the file is
+ * rewritten through a #partial_file, renumbering the pages that follow the headers if needed.
+ *
+ * When limiter is not null, all the reads and writes are charged to it.
+ */
+void apply_delta(const header_delta& delta, io_limiter* limiter = nullptr);
+
+/** \} */
+
+/***********************************************************************************************//**
+ * \defgroup manifest Manifest
+ * \{
+ */
+
+/**
+ * Fingerprint of an Ogg file, with the headers and the audio hashed separately with #fnv1a_hash,
+ * so that a change of tags can be told apart from a change of audio.
+ *
+ * The headers are the raw pages from the identification header to the last header page, which is
+ * also what #header_delta::checksum covers. The audio is the rest of the pages, without their page
+ * number and CRC, because editing tags may renumber them without changing their content.
+ */
+struct file_digest {
+	uint64_t headers = 0;
+	/** Hash of the audio, or 0 when not computed. */
+	uint64_t audio = 0;
+};
+
+/**
+ * Hash the headers of an Ogg stream, and when with_audio is true, the audio too in the same pass.
+ * Otherwise, the file is only read up to the end of the headers.
+ *
+ * Ogg Skeleton streams are ignored, so an indexed file has the same digest as the original.
+ *
+ * When limiter is not null, the reads are charged to it.
+ */
+file_digest digest_file(FILE* input, bool with_audio, io_limiter* limiter = nullptr);
+
+/**
+ * Append the digest of a file to a manifest file, as a line of text containing the two hashes in
+ * hexadecimal followed by the path.
+ */
+void write_manifest_entry(const std::string& path, const file_digest& digest, FILE* output);
+
+/**
+ * Read the next entry of a manifest written by #write_manifest_entry. Return false at the end of
+ * the file.
+ */
+bool read_manifest_entry(FILE* input, std::string& path, file_digest& digest);
+
+/**
+ * Differences between the comments expected for a file and its actual comments, as checked by
+ * --expect.
+ */
+struct tag_mismatch {
+	/** Expected comments that the file lacks. */
+	std::vector<std::string> missing;
+	/** Comments of the file that were not expected. */
+	std::vector<std::string> unexpected;
+	bool empty() const { return missing.empty() && unexpected.empty(); }
+};
+
+/**
+ * Compare the actual comments of a file with the expected ones. Only the fields named in the
+ * expected comments are compared, and the other fields of the file are ignored. Field names are
+ * case-insensitive, values are compared byte for byte, and the order of the comments does not
+ * matter.
+ */
+tag_mismatch compare_tags(const std::list<std::string>& expected, const std::list<std::string>& actual);
+
+/** \} */
+
+/***********************************************************************************************//**
+ * \defgroup resume Resume
+ * \{
+ */
+
+/**
+ * Progress of a rewrite, saved next to its partial file so that the rewrite can resume after an
+ * interruption instead of starting over. The partial file is only trusted up to #output_offset,
+ * which is always the end of a page.
+ */
+struct rewrite_state {
+	/** Identity of the input file, which must not have changed when resuming. */
+	file_identity input;
+	/** #fnv1a_hash of the headers at the beginning of the partial file. */
+	uint64_t header_checksum;
+	/** Size of the headers at the beginning of the partial file. */
+	uint64_t header_length;
+	/** Offset in the input file of the first page not copied yet. */
+	uint64_t input_offset;
+	/** Size of the valid part of the partial file. */
+	uint64_t output_offset;
+	/** Offset in the partial file of the last page copied. */
+	uint64_t last_page_offset;
+	/** Sequence number of the last page copied. */
+	long last_pageno;
+};
+
+/** Path to the file holding the #rewrite_state of a rewrite to the given destination. */
+std::string rewrite_state_path(const std::string& destination);
+
+/**
+ * Replace the saved state atomically, so that a crash leaves either the previous state or the new
+ * one.
+ */
+void save_rewrite_state(const std::string& path, const rewrite_state& state);
+
+/**
+ * Load a state saved by #save_rewrite_state. Return false if there is none, or if it cannot be
+ * parsed, since the rewrite can always start over.
+ */
+bool load_rewrite_state(const std::string& path, rewrite_state& state);
+
+/**
+ * Check that the partial file ends with the last page recorded in the state, intact. The page is
+ * read again, so its CRC is verified.
+ */
+bool check_tail_page(FILE* partial, const rewrite_state& state);
+
+/** \} */
+
+/***********************************************************************************************//**
+ * \defgroup cache Cache
+ * \{
+ */
+
+/**
+ * In-memory cache of the tags of Opus files, for long-running processes that read the tags of the
+ * same files over and over, like --expect when a file is listed several times.
+ *
+ * The entries are keyed by #file_identity, so checking that a cached entry is still valid costs a
+ * single stat call, and modified files are simply cache misses. The stale entries are evicted when
+ * the cache is full, least recently used first.
+ *
+ * The cache is split into shards, each with its own lock, so that concurrent lookups on different
+ * files rarely contend. The memory budget is split evenly between the shards.
+ */
+class header_cache {
+public:
+	/**
+	 * Create an empty cache using at most about max_bytes of memory. The number of shards
+	 * should be greater than the number of threads using the cache.
+	 */
+	explicit header_cache(size_t max_bytes, size_t shard_count = 16);
+	/**
+	 * Return the tags of the Opus file at the given path, reading them from the file only if
+	 * they were not cached already. When limiter is not null, the reads are charged to it.
+	 *
+	 * The returned tags remain valid even if they are evicted from the cache.
+	 */
+	std::shared_ptr<const opus_tags> get(const char* path, io_limiter* limiter = nullptr);
+	/** Number of bytes used by the entries, as estimated for the memory budget. */
+	size_t size() const;
+private:
+	struct entry {
+		file_identity identity;
+		std::shared_ptr<const opus_tags> tags;
+		size_t cost;
+	};
+	struct identity_hash {
+		size_t operator()(const file_identity& id) const;
+	};
+	struct shard {
+		mutable std::mutex mutex;
+		/** Entries, from the most recently used to the least recently used. */
+		std::list<entry> entries;
+		std::unordered_map<file_identity, std::list<entry>::iterator, identity_hash> index;
+		size_t bytes = 0;
+	};
+	std::unique_ptr<shard[]> shards;
+	size_t shard_count;
+	size_t shard_budget;
+};
+
+/** \} */
+
+/***********************************************************************************************//**
+ * \defgroup parallel Parallel
+ * \{
+ */
+
+/**
+ * Outcome of the processing of one file, as reported by a worker thread.
+ */
+struct file_result {
+	/** Position of the file in the list of input files. */
+	size_t index;
+	/** Path to the input file, for the error messages. */
+	std::string path;
+	/** Status of the processing. Its message is shown to the user on error. */
+	status rc = st::ok;
+	/** Edit recorded for --emit-delta. Its data is left empty when there is nothing to record. */
+	header_delta delta;
+	/** Differences with the tags expected by --expect. */
+	tag_mismatch mismatch;
+};
+
+/**
+ * Funnel the results of the worker threads to a single consumer thread, typically the main one,
+ * which reports the errors and aggregates the exit status.
+ *
+ * The workers never wait for each other nor for the consumer: results are pushed onto a lock-free
+ * stack, which the consumer takes as a whole with an atomic exchange. Because the consumer never
+ * removes single nodes, the stack is not subject to the ABA problem.
+ *
+ * When ordered, the results are delivered by increasing index, and the results that arrive early
+ * are held back by the consumer. Otherwise, they are delivered as soon as they are collected.
+ */
+class result_collector {
+public:
+	explicit result_collector(bool ordered) : ordered(ordered) {}
+	result_collector(const result_collector&) = delete;
+	result_collector& operator=(const result_collector&) = delete;
+	~result_collector();
+	/** Add a result. May be called from any thread. */
+	void push(file_result&& result);
+	/**
+	 * Pass the results of indices 0 to count - 1 to f, waiting for the workers to push them.
+	 * Only one thread may collect the results.
+	 */
+	void collect(size_t count, const std::function<void(file_result&)>& f);
+private:
+	struct node {
+		file_result result;
+		node* next;
+	};
+	/** Take all the pushed results, in the order they were pushed. */
+	std::vector<file_result> take();
+	std::atomic<node*> head = nullptr;
+	bool ordered;
+};
+
 /** \} */
 
 /***********************************************************************************************//**
@@ -378,6 +951,21 @@ dynamic_ogg_packet render_tags(const opus_tags& tags);
  * \{
  */
 
+/**
+ * Formats of the comments read by --set-all.
+ */
+enum class comment_format {
+	/** One comment per line, as printed by #print_comments. */
+	text,
+	/**
+	 * A JSON array of comments, or a JSON object mapping the field names to a value or to an
+	 * array of values. Like any JSON, it is encoded in UTF-8.
+	 */
+	json,
+	/** Comments terminated by null bytes, so that they may contain line breaks. */
+	nul,
+};
+
 /**
  * Structured representation of the command-line arguments to opustags.
  */
@@ -436,9 +1024,18 @@ struct options {
 	 *
 	 * The strings are stored in UTF-8.
 	 *
-	 * Option: --delete, --set
+	 * Option: --delete
 	 */
 	std::list<std::string> to_delete;
+	/**
+	 * List of field names whose previously existing comments are replaced by the comments of
+	 * #to_add with the same field name. See #set_comments.
+	 *
+	 * The strings are stored in UTF-8.
+	 *
+	 * Option: --set
+	 */
+	std::list<std::string> to_set;
 	/**
 	 * Delete all the existing comments.
 	 *
@@ -460,6 +1057,103 @@ struct options {
 	 * extract and set as-is, encoding conversion would get in the way.
 	 */
 	bool raw = false;
+	/**
+	 * Lower the I/O priority of opustags so that it does not disturb other processes using the
+	 * same disks.
+	 *
+	 * Option: --background
+	 */
+	bool background = false;
+	/**
+	 * Maximum number of bytes read and written per second, or 0 for no limit.
+	 *
+	 * Option: --io-limit
+	 */
+	uint64_t io_bytes_per_second = 0;
+	/**
+	 * Maximum number of read and write operations per second, or 0 for no limit.
+	 *
+	 * Option: --ops-limit
+	 */
+	uint64_t io_ops_per_second = 0;
+	/**
+	 * Path to the file where the edits are recorded, for replaying them on copies of the
+	 * files with #apply_delta. The special string "-" means stdout. Only usable with
+	 * --in-place.
+	 *
+	 * Option: --emit-delta
+	 */
+	std::optional<std::string> emit_delta;
+	/**
+	 * Path to a delta file to replay instead of editing tags. The special string "-" means
+	 * stdin. No input file may be specified, since they are named by the deltas.
+	 *
+	 * Option: --apply-delta
+	 */
+	std::optional<std::string> apply_delta;
+	/**
+	 * Number of files processed at the same time by worker threads. Errors are reported in the
+	 * order of the files regardless.
+	 *
+	 * Option: --jobs
+	 */
+	size_t jobs = 1;
+	/**
+	 * Number of threads copying the audio of each rewritten file, for very large files on storage
+	 * that is faster with several concurrent streams, like RAID arrays or network file systems.
+	 * The audio is then copied without being parsed. See #copy_range.
+	 *
+	 * Option: --copy-threads
+	 */
+	size_t copy_threads = 1;
+	/**
+	 * Path to the file where the #file_digest of every input file is written, instead of
+	 * editing anything. The special string "-" means stdout.
+	 *
+	 * Option: --manifest
+	 */
+	std::optional<std::string> manifest;
+	/**
+	 * Path to a manifest file whose files are checked for changes, instead of editing tags.
+	 * The special string "-" means stdin.
+	 *
+	 * Option: --check-manifest
+	 */
+	std::optional<std::string> check_manifest;
+	/**
+	 * When checking a manifest, hash the audio too instead of only the headers.
+	 *
+	 * Option: --check-audio
+	 */
+	bool check_audio = false;
+	/**
+	 * Save the progress of the rewrites every so many bytes, and resume the interrupted ones
+	 * instead of starting over. 0 disables it.
+	 *
+	 * Option: --resumable
+	 */
+	uint64_t checkpoint_interval = 0;
+	/**
+	 * Write an Ogg Skeleton stream indexing the audio before it, for fast seeking. Any existing
+	 * Skeleton stream is removed in all cases.
+	 *
+	 * Option: --add-index
+	 */
+	bool add_index = false;
+	/**
+	 * Format of the comments read from standard input by --set-all.
+	 *
+	 * Option: --input-format
+	 */
+	comment_format input_format = comment_format::text;
+	/**
+	 * Path to a JSON file mapping file paths to the comments they are expected to have. The
+	 * files are read but not modified, and the differences are printed. The special string "-"
+	 * means stdin.
+	 *
+	 * Option: --expect
+	 */
+	std::optional<std::string> expect;
 };
 
 /**
@@ -480,10 +1174,14 @@ options parse_options(int argc, char** argv, FILE* comments);
 void print_comments(const std::list<std::string>& comments, FILE* output, bool raw);
 
 /**
- * Parse the comments outputted by #ot::print_comments. Unless raw is true, the comments are
- * converted from the system encoding to UTF-8, and returned as UTF-8.
+ * Parse the comments outputted by #ot::print_comments, or the other formats of #comment_format.
+ * Unless raw is true, the comments are converted from the system encoding to UTF-8, and returned
+ * as UTF-8. JSON is always UTF-8, so it is only validated.
+ *
+ * The input is read as a stream, in linear time.
  */
-std::list<std::string> read_comments(FILE* input, bool raw);
+std::list<std::string> read_comments(FILE* input, bool raw,
+                                     comment_format format = comment_format::text);
 
 /**
  * Remove all comments matching the specified selector, which may either be a field name or a
@@ -493,6 +1191,20 @@ std::list<std::string> read_comments(FILE* input, bool raw);
  */
 void delete_comments(std::list<std::string>& comments, const std::string& selector);
 
+/**
+ * Append the new comments to the existing ones, except for the new comments whose field name is
+ * listed in fields. For each of these fields, the existing comments of that field are removed, and
+ * the new comments of that field take the place of the first removed one. When no comment of that
+ * field existed, the new comments are appended like the others.
+ *
+ * Replacing the comments in place instead of moving them to the end keeps the changes to the
+ * comment header, and therefore to the file, minimal.
+ *
+ * The field names are case-insensitive. The strings are all UTF-8.
+ */
+void set_comments(std::list<std::string>& comments, const std::list<std::string>& additions,
+                  const std::list<std::string>& fields);
+
 /**
  * Main entry point to the opustags program, and pretty much the same as calling opustags from the
  * command-line.
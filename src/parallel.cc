@@ -0,0 +1,72 @@
+/**
+ * \file src/parallel.cc
+ * \ingroup parallel
+ *
+ * Collect the results of worker threads without locks.
+ */
+
+#include <opustags.h>
+
+#include <algorithm>
+#include <map>
+#include <thread>
+
+ot::result_collector::~result_collector()
+{
+	node* n = head.load();
+	while (n) {
+		node* next = n->next;
+		delete n;
+		n = next;
+	}
+}
+
+void ot::result_collector::push(file_result&& result)
+{
+	node* n = new node {std::move(result), head.load(std::memory_order_relaxed)};
+	while (!head.compare_exchange_weak(n->next, n, std::memory_order_release,
+	                                   std::memory_order_relaxed));
+}
+
+std::vector<ot::file_result> ot::result_collector::take()
+{
+	std::vector<file_result> results;
+	node* n = head.exchange(nullptr, std::memory_order_acquire);
+	while (n) {
+		results.push_back(std::move(n->result));
+		node* next = n->next;
+		delete n;
+		n = next;
+	}
+	// The stack yields the most recent result first.
+	std::reverse(results.begin(), results.end());
+	return results;
+}
+
+void ot::result_collector::collect(size_t count, const std::function<void(file_result&)>& f)
+{
+	std::map<size_t, file_result> early; /*< results waiting for their turn when ordered */
+	size_t delivered = 0;
+	while (delivered < count) {
+		std::vector<file_result> results = take();
+		if (results.empty()) {
+			// Files take milliseconds to process at best, so polling costs next to nothing.
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+		for (file_result& result : results) {
+			if (!ordered) {
+				f(result);
+				++delivered;
+			} else if (result.index == delivered) {
+				f(result);
+				++delivered;
+				for (auto it = early.begin(); it != early.end() && it->first == delivered;
+				     it = early.erase(it), ++delivered)
+					f(it->second);
+			} else {
+				early.emplace(result.index, std::move(result));
+			}
+		}
+	}
+}
@@ -0,0 +1,84 @@
+/**
+ * \file src/resume.cc
+ * \ingroup resume
+ *
+ * Save and check the progress of resumable rewrites.
+ *
+ * The state file is a single line of text made of the magic number "OTState1" followed by the
+ * fields of #ot::rewrite_state in decimal, separated by spaces. The identity of the input file is
+ * written as its device, inode, size, and modification time in seconds and nanoseconds.
+ */
+
+#include <opustags.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+
+using namespace std::literals::string_literals;
+
+std::string ot::rewrite_state_path(const std::string& destination)
+{
+	return destination + ".part.state";
+}
+
+void ot::save_rewrite_state(const std::string& path, const rewrite_state& state)
+{
+	partial_file output;
+	output.open(path.c_str());
+	const file_identity& id = state.input;
+	if (fprintf(output.get(), "OTState1 %ju %ju %jd %jd %ld %" PRIu64 " %" PRIu64 " %" PRIu64
+	                          " %" PRIu64 " %" PRIu64 " %ld\n",
+	            (uintmax_t) id.device, (uintmax_t) id.inode, (intmax_t) id.size,
+	            (intmax_t) id.mtime.tv_sec, id.mtime.tv_nsec, state.header_checksum,
+	            state.header_length, state.input_offset, state.output_offset,
+	            state.last_page_offset, state.last_pageno) < 0)
+		throw status {st::standard_error, "fprintf error: "s + strerror(errno)};
+	output.commit();
+}
+
+bool ot::load_rewrite_state(const std::string& path, rewrite_state& state)
+{
+	ot::file input = fopen(path.c_str(), "re");
+	if (input == nullptr)
+		return false;
+	uintmax_t device, inode;
+	intmax_t size, mtime;
+	file_identity& id = state.input;
+	int fields = fscanf(input.get(), "OTState1 %ju %ju %jd %jd %ld %" SCNu64 " %" SCNu64
+	                                 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %ld",
+	                    &device, &inode, &size, &mtime, &id.mtime.tv_nsec,
+	                    &state.header_checksum, &state.header_length, &state.input_offset,
+	                    &state.output_offset, &state.last_page_offset, &state.last_pageno);
+	if (fields != 11)
+		return false;
+	id.device = device;
+	id.inode = inode;
+	id.size = size;
+	id.mtime.tv_sec = mtime;
+	return state.header_length <= state.last_page_offset &&
+	       state.last_page_offset < state.output_offset;
+}
+
+bool ot::check_tail_page(FILE* partial, const rewrite_state& state)
+{
+	if (fseeko(partial, state.last_page_offset, SEEK_SET) == -1)
+		throw status {st::standard_error, "fseeko error: "s + strerror(errno)};
+	std::string tail(state.output_offset - state.last_page_offset, '\0');
+	if (fread(tail.data(), 1, tail.size(), partial) != tail.size()) {
+		if (ferror(partial))
+			throw status {st::standard_error, "fread error: "s + strerror(errno)};
+		return false; // the partial file is shorter than recorded
+	}
+	ogg_sync_state sync;
+	ogg_sync_init(&sync);
+	char* buffer = ogg_sync_buffer(&sync, tail.size());
+	memcpy(buffer, tail.data(), tail.size());
+	ogg_sync_wrote(&sync, tail.size());
+	ogg_page page;
+	// The page must start right at the recorded offset and fill the range exactly.
+	bool intact = ogg_sync_pageseek(&sync, &page) == static_cast<long>(tail.size()) &&
+	              ogg_page_pageno(&page) == state.last_pageno;
+	ogg_sync_clear(&sync);
+	return intact;
+}
@@ -0,0 +1,259 @@
+/**
+ * \file src/skeleton.cc
+ * \ingroup skeleton
+ *
+ * Write Ogg Skeleton 4.0 streams, as specified at https://wiki.xiph.org/Ogg_Skeleton_4.
+ *
+ * The Skeleton stream of a file indexing a single audio stream is laid out like this:
+ *
+ * - the fishead page, first BOS page of the file, followed by the BOS page of the audio,
+ * - the header pages of the audio,
+ * - the fisbone and index packets, on as many pages as the index needs,
+ * - an empty EOS page, before the first audio page.
+ *
+ * Integers are little-endian, and times are expressed in milliseconds.
+ */
+
+#include <opustags.h>
+
+#include <errno.h>
+#include <string.h>
+
+using namespace std::literals::string_literals;
+
+static const size_t head_size = 80;
+static const size_t index_header_size = 42;
+/** Largest variable-length encoding of a 64-bit integer. */
+static const size_t max_varint_size = 10;
+
+bool ot::is_skeleton_stream(const ogg_page& page)
+{
+	return ogg_page_bos(&page) != 0 && page.body_len >= 8 && memcmp(page.body, "fishead\0", 8) == 0;
+}
+
+static void put_integer(unsigned char* out, uint64_t value, int size)
+{
+	for (int i = 0; i < size; ++i) {
+		out[i] = value & 0xFF;
+		value >>= 8;
+	}
+}
+
+static uint64_t get_integer(const unsigned char* in, int size)
+{
+	uint64_t value = 0;
+	for (int i = size - 1; i >= 0; --i)
+		value = (value << 8) | in[i];
+	return value;
+}
+
+/**
+ * Append an integer with 7 bits per byte, least significant first. The high bit marks the last
+ * byte.
+ */
+static void put_varint(std::string& out, uint64_t value)
+{
+	while (value >= 0x80) {
+		out += static_cast<char>(value & 0x7F);
+		value >>= 7;
+	}
+	out += static_cast<char>(value | 0x80);
+}
+
+ot::skeleton_index::skeleton_index(int serialno, codec format, const ogg_packet& identification,
+                                   uint64_t input_size)
+	: serialno(static_cast<int>(static_cast<uint32_t>(serialno) + 1)),
+	  indexed_serialno(serialno), format(format)
+{
+	const unsigned char* id = identification.packet;
+	auto require = [&](long size) {
+		if (identification.bytes < size)
+			throw status {st::error, "Truncated identification header."};
+	};
+	switch (format) {
+	case codec::opus:
+		require(19);
+		granule_rate = 48000;
+		base_granule = get_integer(id + 10, 2); // pre-skip
+		// RFC 7845 recommends decoding 80 ms before the seek point, i.e. 4 packets of 20 ms.
+		preroll = 4;
+		break;
+	case codec::vorbis:
+		require(30);
+		granule_rate = get_integer(id + 12, 4);
+		preroll = 2;
+		break;
+	case codec::flac:
+		// The sample rate is on 20 bits in the STREAMINFO block following the Ogg FLAC header.
+		require(51);
+		granule_rate = (id[27] << 12) | (id[28] << 4) | (id[29] >> 4);
+		break;
+	default:
+		throw status {st::error, "Cannot index this stream."};
+	}
+	if (granule_rate <= 0)
+		throw status {st::error, "Invalid sample rate in the identification header."};
+	last_granule = base_granule;
+	if (input_size == 0)
+		throw status {st::error, "Cannot index an input whose size is unknown."};
+	// Keypoints are at least keypoint_spacing bytes apart, and each one is an offset and a time.
+	size_t max_keypoints = input_size / keypoint_spacing + 1;
+	index_size = index_header_size + max_keypoints * 2 * max_varint_size;
+}
+
+int64_t ot::skeleton_index::granule_time(int64_t granulepos) const
+{
+	int64_t samples = granulepos - base_granule;
+	if (samples <= 0)
+		return 0;
+	return samples / granule_rate * 1000 + samples % granule_rate * 1000 / granule_rate;
+}
+
+ot::dynamic_ogg_packet ot::skeleton_index::render_head() const
+{
+	dynamic_ogg_packet op(head_size);
+	unsigned char* data = op.packet;
+	memset(data, 0, head_size);
+	memcpy(data, "fishead\0", 8);
+	put_integer(data + 8, 4, 2); // version 4.0
+	put_integer(data + 20, 1000, 8); // presentation time denominator
+	put_integer(data + 36, 1000, 8); // base time denominator
+	put_integer(data + 64, next_offset, 8); // segment length
+	put_integer(data + 72, content_offset, 8); // offset of the first non-header page
+	op.b_o_s = 1;
+	op.e_o_s = 0;
+	op.granulepos = 0;
+	op.packetno = 0;
+	return op;
+}
+
+ot::dynamic_ogg_packet ot::skeleton_index::render_bone() const
+{
+	const char* content_type = format == codec::opus ? "audio/opus" :
+	                           format == codec::vorbis ? "audio/vorbis" : "audio/flac";
+	std::string fields = "Content-Type: "s + content_type + "\r\n"
+	                     "Role: audio/main\r\n"
+	                     "Name: audio\r\n";
+	dynamic_ogg_packet op(52 + fields.size());
+	unsigned char* data = op.packet;
+	memset(data, 0, 52);
+	memcpy(data, "fisbone\0", 8);
+	put_integer(data + 8, 44, 4); // offset to the message header fields
+	put_integer(data + 12, static_cast<uint32_t>(indexed_serialno), 4);
+	put_integer(data + 16, header_count, 4);
+	put_integer(data + 20, granule_rate, 8);
+	put_integer(data + 28, 1, 8);
+	put_integer(data + 36, base_granule, 8);
+	put_integer(data + 44, preroll, 4);
+	memcpy(data + 52, fields.data(), fields.size());
+	op.b_o_s = 0;
+	op.e_o_s = 0;
+	op.granulepos = 0;
+	op.packetno = 1;
+	return op;
+}
+
+/**
+ * The index packet is padded with zeros up to its reserved size. Readers only decode the number of
+ * keypoints announced in its header.
+ */
+ot::dynamic_ogg_packet ot::skeleton_index::render_index() const
+{
+	std::string points;
+	uint64_t offset = 0;
+	int64_t time = 0;
+	for (const keypoint& k : keypoints) {
+		put_varint(points, k.offset - offset);
+		put_varint(points, k.time - time);
+		offset = k.offset;
+		time = k.time;
+	}
+	if (index_header_size + points.size() > index_size)
+		throw status {st::error, "The Skeleton index overflowed its reserved space."};
+
+	dynamic_ogg_packet op(index_size);
+	unsigned char* data = op.packet;
+	memset(data, 0, index_size);
+	memcpy(data, "index\0", 6);
+	put_integer(data + 6, static_cast<uint32_t>(indexed_serialno), 4);
+	put_integer(data + 10, keypoints.size(), 8);
+	put_integer(data + 18, 1000, 8); // timestamp denominator
+	put_integer(data + 26, 0, 8); // first sample time
+	put_integer(data + 34, granule_time(last_granule), 8); // last sample time
+	memcpy(data + index_header_size, points.data(), points.size());
+	op.b_o_s = 0;
+	op.e_o_s = 0;
+	op.granulepos = 0;
+	op.packetno = 2;
+	return op;
+}
+
+/** Position of the next page to be written, which requires the output to be seekable. */
+static uint64_t tell(FILE* output)
+{
+	off_t offset = ftello(output);
+	if (offset == -1)
+		throw ot::status {ot::st::standard_error, "ftello error: "s + strerror(errno)};
+	return offset;
+}
+
+void ot::skeleton_index::write_head(ogg_writer& writer)
+{
+	head_offset = tell(writer.file);
+	dynamic_ogg_packet head = render_head();
+	writer.write_header_packet(serialno, 0, head);
+}
+
+void ot::skeleton_index::write_headers(ogg_writer& writer, size_t header_count)
+{
+	this->header_count = header_count;
+	headers_offset = tell(writer.file);
+	std::vector<dynamic_ogg_packet> packets;
+	packets.push_back(render_bone());
+	packets.push_back(render_index());
+	size_t page_count = writer.write_header_packets(serialno, 1, packets);
+
+	dynamic_ogg_packet end(0);
+	end.b_o_s = 0;
+	end.e_o_s = 1;
+	end.granulepos = 0;
+	end.packetno = 3;
+	writer.write_header_packet(serialno, 1 + page_count, end);
+	content_offset = next_offset = tell(writer.file);
+}
+
+void ot::skeleton_index::add_page(const ogg_page& page)
+{
+	// Only pages starting with a fresh packet can be decoded from.
+	bool due = keypoints.empty() || next_offset >= keypoints.back().offset + keypoint_spacing;
+	if (due && !ogg_page_continued(&page))
+		keypoints.push_back({next_offset, granule_time(last_granule)});
+	next_offset += page.header_len + page.body_len;
+	int64_t granulepos = ogg_page_granulepos(&page);
+	if (granulepos != -1)
+		last_granule = granulepos;
+}
+
+/**
+ * The packets keep their size, so the pages are rewritten exactly over the first ones, and only
+ * the file size, the first content offset, and the index change.
+ */
+void ot::skeleton_index::finish(ogg_writer& writer)
+{
+	if (fflush(writer.file) != 0)
+		throw status {st::standard_error, "fflush error: "s + strerror(errno)};
+	if (fseeko(writer.file, head_offset, SEEK_SET) == -1)
+		throw status {st::standard_error, "fseeko error: "s + strerror(errno)};
+	dynamic_ogg_packet head = render_head();
+	writer.write_header_packet(serialno, 0, head);
+
+	if (fseeko(writer.file, headers_offset, SEEK_SET) == -1)
+		throw status {st::standard_error, "fseeko error: "s + strerror(errno)};
+	std::vector<dynamic_ogg_packet> packets;
+	packets.push_back(render_bone());
+	packets.push_back(render_index());
+	writer.write_header_packets(serialno, 1, packets);
+
+	if (fflush(writer.file) != 0 || fseeko(writer.file, 0, SEEK_END) == -1)
+		throw status {st::standard_error, "fseeko error: "s + strerror(errno)};
+}
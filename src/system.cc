@@ -12,18 +12,29 @@
 #include <opustags.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <langinfo.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#ifdef HAVE_IOPRIO_SET
+#  include <sys/syscall.h>
+#endif
+
+#include <algorithm>
+#include <thread>
+
 using namespace std::string_literals;
 
 void ot::partial_file::open(const char* destination)
 {
 	final_name = destination;
 	temporary_name = final_name + ".XXXXXX.part";
+	kept = false;
 	int fd = mkstemps(const_cast<char*>(temporary_name.data()), 5);
 	if (fd == -1)
 		throw status {st::standard_error,
@@ -36,6 +47,44 @@ void ot::partial_file::open(const char* destination)
 		              strerror(errno)};
 }
 
+bool ot::partial_file::open_resumable(const char* destination, bool resume)
+{
+	final_name = destination;
+	temporary_name = final_name + ".part";
+	kept = false;
+	// Unlike the names made by mkstemps, this one is predictable, so never follow a symlink that
+	// someone else could have put there.
+	int fd = -1;
+	if (resume)
+		fd = ::open(temporary_name.c_str(), O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+	bool resumed = fd != -1;
+	if (!resumed)
+		fd = ::open(temporary_name.c_str(), O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0666);
+	if (fd == -1)
+		throw status {st::standard_error,
+		              "Could not create the partial file '" + temporary_name + "': " +
+		              strerror(errno)};
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		throw status {st::error, "The partial file '" + temporary_name + "' is not a regular file."};
+	}
+	if (!resumed && ftruncate(fd, 0) == -1) {
+		close(fd);
+		throw status {st::standard_error,
+		              "Could not truncate the partial file '" + temporary_name + "': " +
+		              strerror(errno)};
+	}
+	file = fdopen(fd, "r+");
+	if (file == nullptr) {
+		close(fd);
+		throw status {st::standard_error,
+		              "Could not get the partial file handle to '" + temporary_name + "': " +
+		              strerror(errno)};
+	}
+	return resumed;
+}
+
 static mode_t get_umask()
 {
 	// libc doesn’t seem to provide a way to get umask without changing it, so we need this workaround.
@@ -86,7 +135,16 @@ void ot::partial_file::abort()
 	if (file == nullptr)
 		return;
 	file.reset();
-	remove(temporary_name.c_str());
+	if (!kept)
+		remove(temporary_name.c_str());
+}
+
+/** Check if an encoding name designates UTF-8, the empty name meaning the locale encoding. */
+static bool is_utf8_encoding(const char* name)
+{
+	if (*name == '\0')
+		name = nl_langinfo(CODESET);
+	return strcasecmp(name, "UTF-8") == 0 || strcasecmp(name, "UTF8") == 0;
 }
 
 ot::encoding_converter::encoding_converter(const char* from, const char* to)
@@ -94,6 +152,7 @@ ot::encoding_converter::encoding_converter(const char* from, const char* to)
 	cd = iconv_open(to, from);
 	if (cd == (iconv_t) -1)
 		throw std::bad_alloc();
+	passthrough = is_utf8_encoding(from) && is_utf8_encoding(to);
 }
 
 ot::encoding_converter::~encoding_converter()
@@ -103,6 +162,11 @@ ot::encoding_converter::~encoding_converter()
 
 std::string ot::encoding_converter::operator()(std::string_view in)
 {
+	if (passthrough) {
+		if (!is_utf8(in))
+			throw status {ot::st::badly_encoded, strerror(EILSEQ) + "."s};
+		return std::string(in);
+	}
 	iconv(cd, nullptr, nullptr, nullptr, nullptr);
 	std::string out;
 	out.reserve(in.size());
@@ -133,6 +197,45 @@ std::string ot::encoding_converter::operator()(std::string_view in)
 	return out;
 }
 
+bool ot::is_utf8(std::string_view text)
+{
+	auto p = reinterpret_cast<const unsigned char*>(text.data());
+	auto end = p + text.size();
+	while (p < end) {
+		// Skip ASCII quickly, as it makes up most tags.
+		if (*p < 0x80) {
+			++p;
+			continue;
+		}
+		size_t length;
+		uint32_t code_point;
+		if (*p >= 0xC2 && *p <= 0xDF) {
+			length = 2;
+			code_point = *p & 0x1F;
+		} else if (*p >= 0xE0 && *p <= 0xEF) {
+			length = 3;
+			code_point = *p & 0x0F;
+		} else if (*p >= 0xF0 && *p <= 0xF4) {
+			length = 4;
+			code_point = *p & 0x07;
+		} else {
+			return false;
+		}
+		if (static_cast<size_t>(end - p) < length)
+			return false;
+		for (size_t i = 1; i < length; ++i) {
+			if ((p[i] & 0xC0) != 0x80)
+				return false;
+			code_point = (code_point << 6) | (p[i] & 0x3F);
+		}
+		if ((length == 3 && code_point < 0x800) || (length == 4 && code_point < 0x10000) ||
+		    (code_point >= 0xD800 && code_point <= 0xDFFF) || code_point > 0x10FFFF)
+			return false;
+		p += length;
+	}
+	return true;
+}
+
 std::string ot::shell_escape(std::string_view word)
 {
 	std::string escaped_word;
@@ -168,12 +271,9 @@ void ot::run_editor(std::string_view editor, std::string_view path)
 		                  "Child process exited with " + std::to_string(WEXITSTATUS(status))};
 }
 
-timespec ot::get_file_timestamp(const char* path)
+static timespec get_mtime(const struct stat& st)
 {
 	timespec mtime;
-	struct stat st;
-	if (stat(path, &st) == -1)
-		throw status {st::standard_error, path + ": stat error: "s + strerror(errno)};
 #if defined(HAVE_STAT_ST_MTIM)
 	mtime = st.st_mtim;
 #elif defined(HAVE_STAT_ST_MTIMESPEC)
@@ -184,3 +284,179 @@ timespec ot::get_file_timestamp(const char* path)
 #endif
 	return mtime;
 }
+
+timespec ot::get_file_timestamp(const char* path)
+{
+	struct stat st;
+	if (stat(path, &st) == -1)
+		throw status {st::standard_error, path + ": stat error: "s + strerror(errno)};
+	return get_mtime(st);
+}
+
+static ot::file_identity make_identity(const struct stat& st)
+{
+	return { st.st_dev, st.st_ino, st.st_size, get_mtime(st) };
+}
+
+ot::file_identity ot::get_file_identity(const char* path)
+{
+	struct stat st;
+	if (stat(path, &st) == -1)
+		throw status {st::standard_error, path + ": stat error: "s + strerror(errno)};
+	return make_identity(st);
+}
+
+ot::file_identity ot::get_file_identity(FILE* file)
+{
+	struct stat st;
+	if (fstat(fileno(file), &st) == -1)
+		throw status {st::standard_error, "fstat error: "s + strerror(errno)};
+	return make_identity(st);
+}
+
+void ot::fnv1a_hash::update(const void* data, size_t size)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; ++i) {
+		value ^= bytes[i];
+		value *= 0x100000001b3;
+	}
+}
+
+/**
+ * The ioprio constants are defined in linux/ioprio.h, which is not always installed, and glibc does
+ * not expose them.
+ */
+void ot::set_idle_io_priority()
+{
+#ifdef HAVE_IOPRIO_SET
+	constexpr int ioprio_who_process = 1;
+	constexpr int ioprio_class_idle = 3;
+	constexpr int ioprio_class_shift = 13;
+	if (syscall(SYS_ioprio_set, ioprio_who_process, 0, ioprio_class_idle << ioprio_class_shift) == -1)
+		throw status {st::standard_error, "ioprio_set error: "s + strerror(errno)};
+#else
+	throw status {st::error, "I/O priorities are not supported on this system."};
+#endif
+}
+
+ot::io_limiter::io_limiter(uint64_t bytes_per_second, uint64_t ops_per_second)
+	: bytes_per_second(bytes_per_second), ops_per_second(ops_per_second),
+	  byte_tokens(bytes_per_second), op_tokens(ops_per_second), last_refill(clock::now())
+{
+}
+
+void ot::io_limiter::acquire(size_t bytes)
+{
+	std::chrono::duration<double> wait {0};
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		clock::time_point now = clock::now();
+		double elapsed = std::chrono::duration<double>(now - last_refill).count();
+		last_refill = now;
+		if (bytes_per_second) {
+			byte_tokens = std::min<double>(byte_tokens + elapsed * bytes_per_second, bytes_per_second);
+			byte_tokens -= bytes;
+			if (byte_tokens < 0)
+				wait = std::max(wait, std::chrono::duration<double>(-byte_tokens / bytes_per_second));
+		}
+		if (ops_per_second) {
+			op_tokens = std::min<double>(op_tokens + elapsed * ops_per_second, ops_per_second);
+			op_tokens -= 1;
+			if (op_tokens < 0)
+				wait = std::max(wait, std::chrono::duration<double>(-op_tokens / ops_per_second));
+		}
+	}
+	// Sleep outside the lock so that the other threads may book their own operations meanwhile.
+	// They will see the debt we left, and wait accordingly.
+	if (wait.count() > 0)
+		std::this_thread::sleep_for(wait);
+}
+
+/** Largest transfer of a single system call, so that the limiter sees a steady flow. */
+static const size_t copy_block_size = 1 << 20;
+
+/**
+ * Copy a chunk with copy_file_range, falling back to pread and pwrite for good as soon as the
+ * kernel tells it cannot copy between these files, like across file systems on older kernels.
+ */
+static void copy_chunk(int input, off_t input_offset, int output, off_t output_offset,
+                       uint64_t length, ot::io_limiter* limiter, std::atomic<bool>& kernel_copy,
+                       std::vector<char>& buffer)
+{
+	while (length > 0) {
+		size_t size = std::min<uint64_t>(length, copy_block_size);
+		// Charge a read and a write, like ogg_reader and ogg_writer do on the normal path.
+		if (limiter) {
+			limiter->acquire(size);
+			limiter->acquire(size);
+		}
+		ssize_t copied = -1;
+#ifdef HAVE_COPY_FILE_RANGE
+		if (kernel_copy) {
+			copied = copy_file_range(input, &input_offset, output, &output_offset, size, 0);
+			if (copied == -1 && errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP &&
+			    errno != EINVAL)
+				throw ot::status {ot::st::standard_error, "copy_file_range error: "s + strerror(errno)};
+			if (copied == -1)
+				kernel_copy = false;
+		}
+#endif
+		if (copied == -1) {
+			buffer.resize(copy_block_size);
+			copied = pread(input, buffer.data(), size, input_offset);
+			if (copied == -1)
+				throw ot::status {ot::st::standard_error, "pread error: "s + strerror(errno)};
+			for (ssize_t written = 0; written < copied; ) {
+				ssize_t rc = pwrite(output, buffer.data() + written, copied - written,
+				                    output_offset + written);
+				if (rc == -1)
+					throw ot::status {ot::st::standard_error, "pwrite error: "s + strerror(errno)};
+				written += rc;
+			}
+			input_offset += copied;
+			output_offset += copied;
+		}
+		if (copied == 0)
+			throw ot::status {ot::st::error, "Unexpected end of file."};
+		length -= copied;
+	}
+}
+
+void ot::copy_range(int input, uint64_t input_offset, int output, uint64_t output_offset,
+                    uint64_t length, size_t threads, io_limiter* limiter, uint64_t chunk_size)
+{
+	// The first chunk only goes up to the first aligned offset in the output.
+	uint64_t first_chunk = std::min(length, chunk_size - output_offset % chunk_size);
+	uint64_t chunk_count = length == 0 ? 0 : 1 + (length - first_chunk + chunk_size - 1) / chunk_size;
+	std::atomic<uint64_t> next_chunk {0};
+	std::atomic<bool> kernel_copy {true};
+	std::atomic<bool> failed {false};
+	std::optional<status> error;
+	std::mutex error_mutex;
+	auto work = [&] {
+		std::vector<char> buffer;
+		uint64_t i;
+		while (!failed && (i = next_chunk++) < chunk_count) {
+			uint64_t begin = i == 0 ? 0 : first_chunk + (i - 1) * chunk_size;
+			uint64_t end = std::min(length, first_chunk + i * chunk_size);
+			try {
+				copy_chunk(input, input_offset + begin, output, output_offset + begin,
+				           end - begin, limiter, kernel_copy, buffer);
+			} catch (const status& rc) {
+				std::lock_guard<std::mutex> lock(error_mutex);
+				if (!error)
+					error = rc;
+				failed = true;
+			}
+		}
+	};
+	std::vector<std::thread> workers;
+	for (uint64_t t = 1; t < std::min<uint64_t>(threads, chunk_count); ++t)
+		workers.emplace_back(work);
+	work();
+	for (std::thread& worker : workers)
+		worker.join();
+	if (error)
+		throw *error;
+}
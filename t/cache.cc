@@ -0,0 +1,91 @@
+#include <opustags.h>
+#include "tap.h"
+
+#include <chrono>
+#include <string.h>
+
+static const char* cache_target = "cache.test.opus";
+
+/** Copy gobble.opus into the test file, with the given tags. */
+static void make_file(const char* tag)
+{
+	ot::options opt;
+	opt.paths_in = {"gobble.opus"};
+	opt.path_out = cache_target;
+	opt.overwrite = true;
+	opt.to_add = {tag};
+	ot::run(opt);
+}
+
+static void check_cache_hits()
+{
+	make_file("TITLE=A");
+	ot::header_cache cache(1 << 20);
+	auto a = cache.get(cache_target);
+	is(a->comments.back(), "TITLE=A", "read the tags through the cache");
+	if (cache.get(cache_target) != a)
+		throw failure("the second lookup should have hit the cache");
+	if (cache.size() == 0)
+		throw failure("the cache should not be empty");
+
+	// Change the size too, in case the timestamp resolution is too coarse.
+	make_file("TITLE=BB");
+	auto b = cache.get(cache_target);
+	is(b->comments.back(), "TITLE=BB", "the modified file was read again");
+	is(a->comments.back(), "TITLE=A", "the previous tags remain valid");
+
+	try {
+		cache.get("gobble.opus.nonexistent");
+		throw failure("reading a missing file should fail");
+	} catch (const ot::status& rc) {
+		is(rc, ot::st::standard_error, "missing file error");
+	}
+	is(remove(cache_target), 0, "remove the test file");
+}
+
+static void check_cache_eviction()
+{
+	size_t one_entry;
+	{
+		ot::header_cache cache(1 << 20, 1);
+		cache.get("gobble.opus");
+		one_entry = cache.size();
+	}
+	make_file("TITLE=A");
+	ot::header_cache cache(one_entry * 3 / 2, 1);
+	auto a = cache.get("gobble.opus");
+	is(cache.size(), one_entry, "one entry fits");
+	auto b = cache.get(cache_target);
+	if (cache.size() > one_entry * 3 / 2 || cache.size() <= one_entry)
+		throw failure("the first entry should have been evicted");
+	if (cache.get(cache_target) != b)
+		throw failure("the last entry should have remained in cache");
+	if (cache.get("gobble.opus") == a)
+		throw failure("the first entry should have been read again");
+	is(remove(cache_target), 0, "remove the test file");
+}
+
+static void check_cache_limiter()
+{
+	ot::header_cache cache(1 << 20);
+	// Empty the bucket first, so that reading the 1 KiB of gobble.opus takes about 100 ms.
+	ot::io_limiter limiter(10000, 0);
+	limiter.acquire(10000);
+	auto start = std::chrono::steady_clock::now();
+	cache.get("gobble.opus", &limiter);
+	if (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(100))
+		throw failure("a cache miss should be charged to the limiter");
+	start = std::chrono::steady_clock::now();
+	cache.get("gobble.opus", &limiter);
+	if (std::chrono::steady_clock::now() - start > std::chrono::milliseconds(50))
+		throw failure("a cache hit should not be charged to the limiter");
+}
+
+int main(int argc, char **argv)
+{
+	plan(3);
+	run(check_cache_hits, "cache hits and misses");
+	run(check_cache_eviction, "cache eviction");
+	run(check_cache_limiter, "cache misses are rate-limited");
+	return 0;
+}
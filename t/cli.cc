@@ -52,6 +52,50 @@ void check_read_comments()
 		if (rc != ot::st::error)
 			throw failure("did not get the expected error reading malformed comments");
 	}
+	{
+		std::string txt = "TITLE=a\nb\0#ARTIST=X\0\0"s;
+		ot::file input = fmemopen((char*) txt.data(), txt.size(), "r");
+		comments = ot::read_comments(input.get(), false, ot::comment_format::nul);
+		auto&& expected = {"TITLE=a\nb", "#ARTIST=X"};
+		if (!std::equal(comments.begin(), comments.end(), expected.begin(), expected.end()))
+			throw failure("parsed null-terminated comments did not match expectations");
+	}
+}
+
+static std::list<std::string> read_json(std::string json)
+{
+	ot::file input = fmemopen((char*) json.data(), json.size(), "r");
+	return ot::read_comments(input.get(), false, ot::comment_format::json);
+}
+
+void check_read_json_comments()
+{
+	auto&& expected = {"TITLE=a\nb", "ARTIST=X", "ARTIST=\xC3\xA9\xF0\x9D\x84\x9E", "X=\"\\/"};
+	std::list<std::string> comments = read_json(R"([ "TITLE=a\nb", "ARTIST=X",
+		"ARTIST=\u00e9\ud834\udd1e", "X=\"\\\/" ])");
+	if (!std::equal(comments.begin(), comments.end(), expected.begin(), expected.end()))
+		throw failure("parsed JSON array did not match expectations");
+	comments = read_json(R"({"TITLE": "a\nb", "ARTIST": ["X", "é𝄞"], "X": "\"\\/"})");
+	if (!std::equal(comments.begin(), comments.end(), expected.begin(), expected.end()))
+		throw failure("parsed JSON object did not match expectations");
+	if (!read_json(" [] ").empty() || !read_json("{}").empty())
+		throw failure("empty JSON lists are not empty");
+
+	for (const char* bad : {"", "[", "[\"A=1\",]", "[\"A=1\"] x", "{\"A\" \"1\"}", "{\"A=B\": \"1\"}",
+	                        "[\"A=\\ud834\"]", "[\"A=\\q\"]", "[\"A=\n\"]", "[1]", "[\"MALFORMED\"]"}) {
+		try {
+			read_json(bad);
+			throw failure("accepted invalid JSON: "s + bad);
+		} catch (const ot::status& rc) {
+			is(rc, ot::st::error, "invalid JSON");
+		}
+	}
+	try {
+		read_json("[\"A=\xFF\"]");
+		throw failure("accepted invalid UTF-8 in JSON");
+	} catch (const ot::status& rc) {
+		is(rc, ot::st::badly_encoded, "invalid UTF-8 in JSON");
+	}
 }
 
 /**
@@ -94,8 +138,8 @@ void check_good_arguments()
 
 	opt = parse({"opustags", "x", "--output", "y", "-D", "-s", "X=Y Z", "-d", "a=b"});
 	if (opt.paths_in.size() != 1 || opt.paths_in.front() != "x" || !opt.path_out ||
-	    opt.path_out != "y" || !opt.delete_all || opt.overwrite || opt.to_delete.size() != 2 ||
-	    opt.to_delete.front() != "X" || *std::next(opt.to_delete.begin()) != "a=b" ||
+	    opt.path_out != "y" || !opt.delete_all || opt.overwrite ||
+	    opt.to_delete != std::list<std::string>{"a=b"} || opt.to_set != std::list<std::string>{"X"} ||
 	    opt.to_add != std::list<std::string>{"X=Y Z"})
 		throw failure("unexpected option parsing result for case #1");
 
@@ -118,6 +162,10 @@ void check_good_arguments()
 	opt = parse({"opustags", "-a", "X=\xFF", "--raw", "x"});
 	if (!opt.raw || opt.to_add.front() != "X=\xFF")
 		throw failure("--raw did not disable transcoding");
+
+	opt = parse({"opustags", "--background", "--io-limit", "2M", "--ops-limit=300", "x"});
+	if (!opt.background || opt.io_bytes_per_second != 2 << 20 || opt.io_ops_per_second != 300)
+		throw failure("unexpected option parsing result for the I/O limits");
 }
 
 void check_bad_arguments()
@@ -152,6 +200,10 @@ void check_bad_arguments()
 	error_case({"opustags", "-o", "x", "--output", "y", "z"},
 	           "Cannot specify --output more than once.", "double output");
 	error_code_case({"opustags", "-S", "x"}, "Malformed tag: INVALID", ot::st::error, "attempt to read invalid argument with -S");
+	error_case({"opustags", "--input-format", "xml", "-S", "x"}, "Invalid value for --input-format: xml.",
+	           "unknown input format");
+	error_case({"opustags", "--input-format", "json", "x"}, "Cannot use --input-format without --set-all.",
+	           "input format without --set-all");
 	error_case({"opustags", "-o", "", "--output", "y", "z"},
 	           "Cannot specify --output more than once.", "double output with first filename empty");
 	error_case({"opustags", "-e", "-i", "x", "y"},
@@ -176,6 +228,12 @@ void check_bad_arguments()
 	error_case({"opustags", "-s", "X=\xFF", "x"},
 	           "Could not encode argument into UTF-8: Invalid or incomplete multibyte or wide character.",
 	           "-s with binary data");
+	error_case({"opustags", "--io-limit", "10X", "x"}, "Invalid value for --io-limit: 10X.", "bad I/O limit suffix");
+	error_case({"opustags", "--ops-limit", "0", "x"}, "Invalid value for --ops-limit: 0.", "null operations limit");
+	error_case({"opustags", "--emit-delta", "d", "x", "-o", "y"},
+	           "Cannot use --emit-delta without --in-place.", "emitting deltas without --in-place");
+	error_case({"opustags", "--apply-delta", "d", "-s", "X=Y"},
+	           "Cannot mix --apply-delta with -oieadDsS or --emit-delta.", "applying deltas while editing");
 }
 
 static void check_delete_comments()
@@ -201,12 +259,114 @@ static void check_delete_comments()
 		throw failure("did not delete a specific title correctly");
 }
 
+static void check_set_comments()
+{
+	using C = std::list<std::string>;
+	C original = {"TITLE=X", "ARTIST=A", "Title=Y", "artIst=B", "GENRE=G"};
+
+	C edited = original;
+	ot::set_comments(edited, {"DATE=1", "title=Z"}, {"TITLE"});
+	C expected = {"title=Z", "ARTIST=A", "artIst=B", "GENRE=G", "DATE=1"};
+	if (edited != expected)
+		throw failure("did not replace the title in place");
+
+	edited = original;
+	ot::set_comments(edited, {"ARTIST=C", "X=1", "ARTIST=D", "GENRE=H"}, {"artist", "X", "Artist"});
+	expected = {"TITLE=X", "ARTIST=C", "ARTIST=D", "Title=Y", "GENRE=G", "X=1", "GENRE=H"};
+	if (edited != expected)
+		throw failure("did not replace multiple values in place");
+}
+
+static ogg_packet make_packet(const char* contents)
+{
+	ogg_packet op {};
+	op.bytes = strlen(contents);
+	op.packet = (unsigned char*) contents;
+	return op;
+}
+
+/**
+ * Build a minimal Vorbis stream, where the comment and setup headers share a page, and set a tag
+ * large enough to push the headers over several pages. The audio page must then be renumbered,
+ * both by the edit and by the replay of its delta on a copy of the file.
+ */
+static void check_vorbis_edit()
+{
+	static const char* target = "vorbis.test.ogg";
+	static const char* copy = "vorbis-copy.test.ogg";
+	static const char* delta = "vorbis.test.delta";
+	{
+		ot::file output = fopen(target, "w");
+		ot::file output_copy = fopen(copy, "w");
+		for (FILE* f : {output.get(), output_copy.get()}) {
+			ot::opus_tags tags;
+			tags.codec = ot::codec::vorbis;
+			tags.vendor = "opustags test";
+			tags.extra_data = "\x01";
+			std::vector<ot::dynamic_ogg_packet> headers;
+			headers.push_back(ot::render_tags(tags));
+			headers.emplace_back(make_packet("\x05vorbis"));
+			ogg_packet id_packet = make_packet("\x01vorbis");
+			id_packet.b_o_s = 1;
+			ogg_packet audio_packet = make_packet("audio");
+			audio_packet.e_o_s = 1;
+			ot::ogg_writer writer(f);
+			writer.write_header_packet(1234, 0, id_packet);
+			writer.write_header_packets(1234, 1, headers);
+			writer.write_header_packet(1234, 2, audio_packet);
+		}
+	}
+
+	ot::options opt;
+	opt.paths_in = {target};
+	opt.in_place = true;
+	opt.overwrite = true;
+	opt.to_add = {"LARGE=" + std::string(70000, 'x'), "TITLE=Vorbis"};
+	opt.emit_delta = delta;
+	ot::run(opt);
+
+	ot::file input = fopen(target, "r");
+	ot::ogg_reader reader(input.get());
+	reader.next_page();
+	reader.next_page();
+	std::vector<ot::dynamic_ogg_packet> headers;
+	reader.read_header_packets([&headers](ogg_packet& p) {
+		headers.emplace_back(p);
+		return headers.size() < 2;
+	});
+	ot::opus_tags tags = ot::parse_tags(headers[0], ot::codec::vorbis);
+	if (tags.comments.back() != "TITLE=Vorbis" || tags.extra_data != "\x01")
+		throw failure("unexpected comment header");
+	if (headers[1].bytes != 7 || memcmp(headers[1].packet, "\x05vorbis", 7) != 0)
+		throw failure("the setup header was not preserved");
+	if (ogg_page_pageno(&reader.page) != 2 || !reader.next_page() || ogg_page_pageno(&reader.page) != 3)
+		throw failure("the audio page was not renumbered");
+
+	ot::header_delta d;
+	{
+		ot::file delta_input = fopen(delta, "r");
+		if (!ot::read_delta(delta_input.get(), d))
+			throw failure("could not read the delta");
+	}
+	is(d.page_shift, 1, "delta page shift");
+	d.path = copy;
+	ot::apply_delta(d);
+	if (read_file(copy) != read_file(target))
+		throw failure("replaying the delta did not reproduce the edit");
+
+	for (const char* path : {target, copy, delta})
+		remove(path);
+}
+
 int main(int argc, char **argv)
 {
-	std::cout << "1..4\n";
+	std::cout << "1..7\n";
 	run(check_read_comments, "check tags parsing");
+	run(check_read_json_comments, "check JSON tags parsing");
 	run(check_good_arguments, "check options parsing");
 	run(check_bad_arguments, "check options parsing errors");
 	run(check_delete_comments, "delete comments");
+	run(check_set_comments, "set comments");
+	run(check_vorbis_edit, "edit a Vorbis stream");
 	return 0;
 }
@@ -0,0 +1,109 @@
+#include <opustags.h>
+#include "tap.h"
+
+#include <string.h>
+
+using namespace std::literals::string_literals;
+
+static const char* delta_target = "delta.test";
+
+static ot::header_delta make_delta(const std::string& original, size_t offset, size_t length,
+                                   const std::string& data)
+{
+	ot::header_delta delta;
+	delta.path = delta_target;
+	delta.file_size = original.size();
+	delta.offset = offset;
+	delta.length = length;
+	ot::fnv1a_hash hash;
+	hash.update(original.data(), offset + length);
+	delta.checksum = hash.value;
+	delta.data = data;
+	return delta;
+}
+
+static void check_delta_file()
+{
+	std::string original = "0123456789";
+	ot::header_delta a = make_delta(original, 2, 3, "abc");
+	ot::header_delta b = make_delta(original, 4, 0, "\0\xFF"s);
+	b.page_shift = -2;
+	char* buffer;
+	size_t size;
+	{
+		ot::file output = open_memstream(&buffer, &size);
+		ot::write_delta(a, output.get());
+		ot::write_delta(b, output.get());
+	}
+	std::string contents(buffer, size);
+	free(buffer);
+	is(contents.size(), 2 * (8 + 4 + strlen(delta_target) + 4 * 8 + 4 + 4) + 5, "delta file size");
+
+	ot::file input = fmemopen(contents.data(), contents.size(), "r");
+	ot::header_delta c;
+	for (const ot::header_delta* expected : {&a, &b}) {
+		if (!ot::read_delta(input.get(), c))
+			throw failure("could not read back a delta");
+		if (c.path != expected->path || c.file_size != expected->file_size ||
+		    c.offset != expected->offset || c.length != expected->length ||
+		    c.checksum != expected->checksum || c.page_shift != expected->page_shift ||
+		    c.data != expected->data)
+			throw failure("the delta read back differs");
+	}
+	if (ot::read_delta(input.get(), c))
+		throw failure("did not detect the end of the delta file");
+
+	contents.resize(contents.size() - 1);
+	input = fmemopen(contents.data(), contents.size(), "r");
+	ot::read_delta(input.get(), c);
+	try {
+		ot::read_delta(input.get(), c);
+		throw failure("did not detect the truncated delta");
+	} catch (const ot::status& rc) {
+		is(rc.message, "Truncated delta file.", "truncated delta error");
+	}
+}
+
+static void check_apply_delta()
+{
+	std::string original = "0123456789";
+	write_file(delta_target, original);
+	ot::apply_delta(make_delta(original, 2, 3, "abc"));
+	is(read_file(delta_target), "01abc56789", "same-size delta");
+
+	original = "01abc56789";
+	ot::apply_delta(make_delta(original, 2, 3, "ABCDE"));
+	is(read_file(delta_target), "01ABCDE56789", "larger delta");
+
+	try {
+		ot::apply_delta(make_delta("01ABCDX56789", 2, 5, "x"));
+		throw failure("applied a delta on a different file");
+	} catch (const ot::status& rc) {
+		is(rc.message, "The header does not match the original file.", "checksum mismatch");
+	}
+	try {
+		ot::apply_delta(make_delta("0123", 2, 0, "x"));
+		throw failure("applied a delta on a file of a different size");
+	} catch (const ot::status& rc) {
+		is(rc.message, "The file size does not match the original file.", "size mismatch");
+	}
+	is(read_file(delta_target), "01ABCDE56789", "the file was left intact on error");
+
+	// 7 bytes of headers are read, 5 bytes written, and 5 bytes copied, so 22 bytes in total.
+	using namespace std::chrono;
+	ot::io_limiter limiter(16, 0);
+	auto start = steady_clock::now();
+	ot::apply_delta(make_delta("01ABCDE56789", 2, 5, "xyz"), &limiter);
+	if (steady_clock::now() - start < milliseconds(200))
+		throw failure("the limiter was not used");
+	is(read_file(delta_target), "01xyz56789", "smaller delta with an I/O limit");
+	is(remove(delta_target), 0, "remove the test file");
+}
+
+int main(int argc, char **argv)
+{
+	plan(2);
+	run(check_delta_file, "write and read delta files");
+	run(check_apply_delta, "apply deltas");
+	return 0;
+}
@@ -0,0 +1,103 @@
+#include <opustags.h>
+#include "tap.h"
+
+#include <string.h>
+
+using namespace std::literals::string_literals;
+
+static void check_manifest_file()
+{
+	ot::file_digest a {0x0123456789abcdef, 0};
+	ot::file_digest b {1, 0xfedcba9876543210};
+	char* buffer;
+	size_t size;
+	{
+		ot::file output = open_memstream(&buffer, &size);
+		ot::write_manifest_entry("a.opus", a, output.get());
+		ot::write_manifest_entry(" b c.opus", b, output.get());
+	}
+	std::string contents(buffer, size);
+	free(buffer);
+	is(contents, "0123456789abcdef 0000000000000000 a.opus\n"
+	             "0000000000000001 fedcba9876543210  b c.opus\n", "manifest contents");
+
+	ot::file input = fmemopen(contents.data(), contents.size(), "r");
+	std::string path;
+	ot::file_digest digest;
+	for (auto [expected_path, expected] : {std::pair("a.opus", a), std::pair(" b c.opus", b)}) {
+		if (!ot::read_manifest_entry(input.get(), path, digest))
+			throw failure("could not read back an entry");
+		if (path != expected_path || digest.headers != expected.headers ||
+		    digest.audio != expected.audio)
+			throw failure("the entry read back differs");
+	}
+	if (ot::read_manifest_entry(input.get(), path, digest))
+		throw failure("did not detect the end of the manifest");
+
+	for (std::string line : {"0123 0000000000000000 a.opus\n"s,
+	                         "0123456789abcdeg 0000000000000000 a.opus\n"s,
+	                         "0123456789abcdef 0000000000000000 \n"s}) {
+		input = fmemopen(line.data(), line.size(), "r");
+		try {
+			ot::read_manifest_entry(input.get(), path, digest);
+			throw failure("accepted an invalid line: " + line);
+		} catch (const ot::status& rc) {
+			is(rc, ot::st::error, "invalid manifest line");
+		}
+	}
+
+	try {
+		ot::write_manifest_entry("a\nb", a, stdout);
+		throw failure("accepted a path with a line break");
+	} catch (const ot::status& rc) {
+		is(rc, ot::st::error, "path with a line break");
+	}
+}
+
+static void check_digest()
+{
+	ot::file input = fopen("gobble.opus", "r");
+	ot::file_digest full = ot::digest_file(input.get(), true);
+	input = fopen("gobble.opus", "r");
+	ot::file_digest headers_only = ot::digest_file(input.get(), false);
+	is(headers_only.headers, full.headers, "same header hash with or without the audio");
+	is(headers_only.audio, 0u, "audio not hashed");
+	if (full.audio == 0 || full.audio == full.headers)
+		throw failure("unexpected audio hash");
+
+	// gobble.opus is about 1.2 KB, which exceeds the initial budget of the limiter.
+	using namespace std::chrono;
+	ot::io_limiter limiter(1000, 0);
+	input = fopen("gobble.opus", "r");
+	auto start = steady_clock::now();
+	ot::file_digest limited = ot::digest_file(input.get(), true, &limiter);
+	if (steady_clock::now() - start < milliseconds(100))
+		throw failure("the limiter was not used");
+	is(limited.audio, full.audio, "same audio hash with a limiter");
+}
+
+static void check_compare_tags()
+{
+	std::list<std::string> actual = {"TITLE=Foo", "artist=X", "ARTIST=Y", "ENCODER=z", "ARTISTS=W"};
+	ot::tag_mismatch mismatch = ot::compare_tags({"Artist=Y", "ARTIST=X", "title=Foo"}, actual);
+	if (!mismatch.empty())
+		throw failure("matching tags were reported as different");
+
+	mismatch = ot::compare_tags({"ARTIST=X", "ARTIST=Z", "TITLE=foo", "GENRE=Jazz"}, actual);
+	std::vector<std::string> missing = {"ARTIST=Z", "GENRE=Jazz", "TITLE=foo"};
+	std::vector<std::string> unexpected = {"ARTIST=Y", "TITLE=Foo"};
+	if (mismatch.missing != missing || mismatch.unexpected != unexpected)
+		throw failure("unexpected differences");
+
+	if (!ot::compare_tags({}, actual).empty())
+		throw failure("fields not expected were checked");
+}
+
+int main(int argc, char **argv)
+{
+	std::cout << "1..3\n";
+	run(check_manifest_file, "read and write manifests");
+	run(check_digest, "hash a file");
+	run(check_compare_tags, "compare expected tags");
+	return 0;
+}
@@ -22,6 +22,7 @@ static void check_ref_ogg()
 
 	if (reader.next_page() != true)
 		throw failure("could not read the second page");
+	is(reader.page_offset, 47u, "second page offset");
 	reader.process_header_packet([](ogg_packet& p) {
 		if (p.bytes != 62)
 			throw failure("unexpected length for the second packet");
@@ -137,14 +138,111 @@ void check_identification()
 		"\xe6\xc7\x00\x00\x00\x00\x7e\xc3\x57\x2b\x01\x13";
 	if (ot::is_opus_stream(id))
 		throw failure("was not the beginning of a stream");
+	id.header = good_header;
+
+	id.body = (unsigned char*) "\x01vorbisABCD";
+	if (ot::identify_stream(id) != ot::codec::vorbis)
+		throw failure("could not identify vorbis header");
+	id.body = (unsigned char*) "\x7F" "FLAC\x01\x00\x00\x01fLaC";
+	if (ot::identify_stream(id) != ot::codec::flac)
+		throw failure("could not identify flac header");
+	id.body = (unsigned char*) "Not_OpusHead";
+	if (ot::identify_stream(id) != ot::codec::unknown)
+		throw failure("identified an unknown codec");
+}
+
+/**
+ * Write headers spanning several pages, with a large packet and packets sharing a page, then read
+ * them back and renumber the pages.
+ */
+static void check_header_packets()
+{
+	std::string large(70000, 'x');
+	std::vector<ot::dynamic_ogg_packet> packets;
+	packets.emplace_back(make_packet("Comments"));
+	packets.emplace_back(make_packet(large.c_str()));
+	packets.emplace_back(make_packet("Setup"));
+	char* buffer;
+	size_t size;
+	size_t page_count;
+	{
+		ot::file output = open_memstream(&buffer, &size);
+		ot::ogg_writer writer(output.get());
+		page_count = writer.write_header_packets(1234, 1, packets);
+		writer.write_header_packet(1234, page_count + 1, packets.back());
+	}
+	std::string stream(buffer, size);
+	free(buffer);
+	is(page_count, 2u, "header page count");
+
+	std::vector<ot::dynamic_ogg_packet> read;
+	std::string raw_pages;
+	{
+		ot::file input = fmemopen(stream.data(), stream.size(), "r");
+		ot::ogg_reader reader(input.get());
+		if (!reader.next_page())
+			throw failure("could not read the first page");
+		reader.read_header_packets([&read](ogg_packet& p) {
+			read.emplace_back(p);
+			return read.size() < 3;
+		}, &raw_pages);
+		if (ogg_page_pageno(&reader.page) != 2)
+			throw failure("the reader did not stop on the last header page");
+		if (!reader.next_page() || ogg_page_pageno(&reader.page) != 3)
+			throw failure("could not read the page after the headers");
+	}
+	if (read.size() != 3 || !same_packet(read[0], packets[0]) ||
+	    !same_packet(read[1], packets[1]) || !same_packet(read[2], packets[2]))
+		throw failure("the header packets read back differ");
+	if (raw_pages.size() >= stream.size() || stream.compare(0, raw_pages.size(), raw_pages) != 0)
+		throw failure("unexpected raw header pages");
+
+	// Renumbering must keep the checksum valid, or the reader would reject the page.
+	std::string renumbered;
+	{
+		ot::file input = fmemopen(stream.data(), stream.size(), "r");
+		ot::ogg_reader reader(input.get());
+		ot::file output = open_memstream(&buffer, &size);
+		ot::ogg_writer writer(output.get());
+		while (reader.next_page()) {
+			ot::renumber_page(reader.page, ogg_page_pageno(&reader.page) + 5);
+			writer.write_page(reader.page);
+		}
+	}
+	renumbered.assign(buffer, size);
+	free(buffer);
+	ot::file input = fmemopen(renumbered.data(), renumbered.size(), "r");
+	ot::ogg_reader reader(input.get());
+	for (long pageno = 6; pageno <= 8; ++pageno) {
+		if (!reader.next_page() || ogg_page_pageno(&reader.page) != pageno)
+			throw failure("unexpected renumbered page");
+	}
+}
+
+/** The limiter is only charged for the bytes actually read, and gobble.opus is about 1 KiB. */
+static void check_limited_reader()
+{
+	using namespace std::chrono;
+	ot::io_limiter limiter(10000, 0);
+	ot::file input = fopen("gobble.opus", "r");
+	if (input == nullptr)
+		throw failure("could not open gobble.opus");
+	ot::ogg_reader reader(input.get());
+	reader.limiter = &limiter;
+	auto start = steady_clock::now();
+	while (reader.next_page());
+	if (steady_clock::now() - start > milliseconds(500))
+		throw failure("the reader was charged for more than it read");
 }
 
 int main(int argc, char **argv)
 {
-	std::cout << "1..4\n";
+	std::cout << "1..6\n";
 	run(check_ref_ogg, "check a reference ogg stream");
 	run(check_memory_ogg, "build and check a fresh stream");
 	run(check_bad_stream, "read a non-ogg stream");
 	run(check_identification, "stream identification");
+	run(check_header_packets, "multi-page headers");
+	run(check_limited_reader, "charge the limiter for the bytes read");
 	return 0;
 }
@@ -32,10 +32,10 @@ static void parse_standard()
 		throw failure("found mysterious padding data");
 }
 
-static ot::status try_parse_tags(const ogg_packet& packet)
+static ot::status try_parse_tags(const ogg_packet& packet, ot::codec format = ot::codec::opus)
 {
 	try {
-		ot::parse_tags(packet);
+		ot::parse_tags(packet, format);
 		return ot::st::ok;
 	} catch (const ot::status& rc) {
 		return rc;
@@ -137,12 +137,74 @@ static void recode_padding()
 		throw failure("the rendered packet is not what we expected");
 }
 
+static void recode_vorbis()
+{
+	std::string body(standard_OpusTags + 8, sizeof(standard_OpusTags) - 9);
+	std::string vorbis_comment = "\x03vorbis" + body + "\x01";
+	ogg_packet op;
+	op.bytes = vorbis_comment.size();
+	op.packet = (unsigned char*) vorbis_comment.data();
+	ot::opus_tags tags = ot::parse_tags(op, ot::codec::vorbis);
+	if (tags.comments.size() != 2 || tags.comments.back() != "ARTIST=Bar")
+		throw failure("bad comments");
+	if (tags.extra_data != "\x01")
+		throw failure("the framing bit was not preserved as extra data");
+	tags.comments.pop_back();
+	auto packet = ot::render_tags(tags);
+	std::string expected = vorbis_comment.substr(0, vorbis_comment.size() - 15);
+	expected[7 + 4 + 20] = 1;
+	expected += "\x01";
+	if (static_cast<size_t>(packet.bytes) != expected.size() ||
+	    memcmp(packet.packet, expected.data(), packet.bytes) != 0)
+		throw failure("the rendered packet is not what we expected");
+}
+
+static void recode_flac()
+{
+	std::string body(standard_OpusTags + 8, sizeof(standard_OpusTags) - 9);
+	std::string flac_comment = "\x84\x00\x00"s + static_cast<char>(body.size()) + body;
+	ogg_packet op;
+	op.bytes = flac_comment.size();
+	op.packet = (unsigned char*) flac_comment.data();
+	ot::opus_tags tags = ot::parse_tags(op, ot::codec::flac);
+	if (!tags.last_metadata_block || tags.comments.front() != "TITLE=Foo")
+		throw failure("bad metadata block");
+	if (!ot::is_last_header_packet(ot::codec::flac, op, 1))
+		throw failure("the last metadata block was not detected");
+	auto packet = ot::render_tags(tags);
+	if (static_cast<size_t>(packet.bytes) != flac_comment.size() ||
+	    memcmp(packet.packet, flac_comment.data(), packet.bytes) != 0)
+		throw failure("the rendered packet is not what we expected");
+
+	flac_comment[3] = flac_comment[3] + 1;
+	if (try_parse_tags(op, ot::codec::flac) != ot::st::bad_magic_number)
+		throw failure("did not detect the inconsistent block length");
+}
+
+/** gobble.opus is about 1.2 KB, which exceeds the initial budget of the limiter. */
+static void read_limited_tags()
+{
+	using namespace std::chrono;
+	ot::io_limiter limiter(1000, 0);
+	ot::file input = fopen("gobble.opus", "r");
+	if (input == nullptr)
+		throw failure("could not open gobble.opus");
+	auto start = steady_clock::now();
+	ot::opus_tags tags = ot::read_tags(input.get(), &limiter);
+	if (steady_clock::now() - start < milliseconds(100))
+		throw failure("the limiter was not used");
+	is(tags.comments.front(), "encoder=Lavc58.18.100 libopus", "read the tags");
+}
+
 int main()
 {
-	std::cout << "1..4\n";
+	std::cout << "1..7\n";
 	run(parse_standard, "parse a standard OpusTags packet");
 	run(parse_corrupted, "correctly reject invalid packets");
 	run(recode_standard, "recode a standard OpusTags packet");
 	run(recode_padding, "recode a OpusTags packet with padding");
+	run(recode_vorbis, "recode a Vorbis comment header");
+	run(recode_flac, "recode a FLAC comment metadata block");
+	run(read_limited_tags, "read the tags with an I/O limit");
 	return 0;
 }
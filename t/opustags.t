@@ -4,7 +4,7 @@ use strict;
 use warnings;
 use utf8;
 
-use Test::More tests => 50;
+use Test::More tests => 99;
 
 use Digest::MD5;
 use File::Basename;
@@ -73,6 +73,20 @@ Options:
   -S, --set-all                 import comments from standard input
   -e, --edit                    edit tags interactively in VISUAL/EDITOR
   --raw                         disable encoding conversion
+  --background                  use the idle I/O priority
+  --io-limit BYTES              limit the I/O throughput per second
+  --ops-limit COUNT             limit the I/O operations per second
+  --emit-delta FILE             record the edits made with --in-place
+  --apply-delta FILE            replay the edits recorded with --emit-delta
+  --jobs COUNT                  process COUNT files at the same time
+  --copy-threads COUNT          copy the audio of each file on COUNT threads
+  --manifest FILE               write the hashes of the headers and of the audio
+  --check-manifest FILE         list the files changed since --manifest
+  --check-audio                 check the audio too with --check-manifest
+  --resumable[=BYTES]           save the progress of rewrites every BYTES
+  --add-index                   index the audio with Ogg Skeleton for fast seeking
+  --input-format FORMAT         read --set-all comments as text, json or nul
+  --expect FILE                 check the tags against those listed in FILE
 
 See the man page for extensive documentation.
 EOF
@@ -125,19 +139,25 @@ is_deeply(opustags(qw(gobble.opus -o out.opus --overwrite)), ['', '', 0], 'overw
 is(md5('out.opus'), '111a483596ac32352fbce4d14d16abd2', 'successfully overwritten');
 is((stat 'out.opus')[2] & 0777, 0604, 'overwriting preserves output file\'s mode');
 
+is_deeply(opustags(qw(gobble.opus -o out.opus -y --io-limit 1M --ops-limit 1000)), ['', '', 0], 'copy with an I/O budget');
+is(md5('out.opus'), '111a483596ac32352fbce4d14d16abd2', 'the rate-limited copy is faithful');
+is_deeply(opustags(qw(gobble.opus -o out.opus -y --io-limit -5)), ['', <<'EOF', 512], 'negative I/O budget');
+error: Invalid value for --io-limit: -5.
+EOF
+
 chmod(0700, 'out.opus');
 is_deeply(opustags(qw(--in-place out.opus -a A=B --add=A=C --add), "TITLE=Foo Bar",
                    qw(--delete A --add TITLE=七面鳥 --set encoder=whatever -s 1=2 -s X=1 -a X=2 -s X=3)),
           ['', '', 0], 'complex tag editing');
-is(md5('out.opus'), '66780307a6081523dc9040f3c47b0448', 'check the footprint');
+is(md5('out.opus'), '49782b358dd541bf494f00d63b973a1d', 'check the footprint');
 is((stat 'out.opus')[2] & 0777, 0700, 'in-place editing preserves file mode');
 
 is_deeply(opustags('out.opus'), [<<'EOF', '', 0], 'check the tags written');
+encoder=whatever
 A=B
 A=C
 TITLE=Foo Bar
 TITLE=七面鳥
-encoder=whatever
 1=2
 X=1
 X=2
@@ -145,18 +165,30 @@ X=3
 EOF
 
 is_deeply(opustags(qw(out.opus -d A -d foo -s X=4 -a TITLE=gobble -d title=七面鳥)), [<<'EOF', '', 0], 'dry editing');
-TITLE=Foo Bar
 encoder=whatever
+TITLE=Foo Bar
 1=2
 X=4
 TITLE=gobble
 EOF
-is(md5('out.opus'), '66780307a6081523dc9040f3c47b0448', 'the file did not change');
+
+is_deeply(opustags(qw(out.opus -s TITLE=Bar -a title=Baz)), [<<'EOF', '', 0], 'set in place');
+encoder=whatever
+A=B
+A=C
+TITLE=Bar
+title=Baz
+1=2
+X=1
+X=2
+X=3
+EOF
+is(md5('out.opus'), '49782b358dd541bf494f00d63b973a1d', 'the file did not change');
 
 is_deeply(opustags(qw(-i out.opus -a fatal=yes -a FOO -a BAR)), ['', <<'EOF', 512], 'bad tag with --add');
 error: Comment does not contain an equal sign: FOO.
 EOF
-is(md5('out.opus'), '66780307a6081523dc9040f3c47b0448', 'the file did not change');
+is(md5('out.opus'), '49782b358dd541bf494f00d63b973a1d', 'the file did not change');
 
 is_deeply(opustags('out.opus', '-D', '-a', "X=foo\nbar\tquux"), [<<'END_OUT', <<'END_ERR', 0], 'control characters');
 X=foo
@@ -169,7 +201,7 @@ END_ERR
 is_deeply(opustags(qw(-i out.opus -s fatal=yes -s FOO -s BAR)), ['', <<'EOF', 512], 'bad tag with --set');
 error: Comment does not contain an equal sign: FOO.
 EOF
-is(md5('out.opus'), '66780307a6081523dc9040f3c47b0448', 'the file did not change');
+is(md5('out.opus'), '49782b358dd541bf494f00d63b973a1d', 'the file did not change');
 
 is_deeply(opustags(qw(out.opus --delete-all -a OK=yes)), [<<'EOF', '', 0], 'delete all');
 OK=yes
@@ -199,6 +231,31 @@ END_OUT
 error: Malformed tag: whatever
 END_ERR
 
+is_deeply(opustags(qw(out.opus -S --input-format json -o out2.opus), {in => <<'END_IN'}), ['', '', 0], 'set all from JSON');
+{"TITLE": "two\nlines", "ARTIST": ["七面鳥", "\u00e9"]}
+END_IN
+is_deeply(opustags(qw(out2.opus)), [<<'END_OUT', <<'END_ERR', 0], 'the tags were read from JSON');
+TITLE=two
+lines
+ARTIST=七面鳥
+ARTIST=é
+END_OUT
+warning: Some tags contain unsupported newline characters.
+END_ERR
+is_deeply(opustags(qw(out.opus -S --input-format nul -o out2.opus -y), {in => "TITLE=two\nlines\0ARTIST=七面鳥\0ARTIST=é\0"}), ['', '', 0], 'set all from null-terminated comments');
+is_deeply(opustags(qw(out2.opus)), [<<'END_OUT', <<'END_ERR', 0], 'the tags were read from null-terminated comments');
+TITLE=two
+lines
+ARTIST=七面鳥
+ARTIST=é
+END_OUT
+warning: Some tags contain unsupported newline characters.
+END_ERR
+is_deeply(opustags(qw(out.opus -S --input-format json), {in => '["TITLE=x",]'}), ['', <<'END_ERR', 256], 'set all from invalid JSON');
+error: Invalid JSON input at byte 12: expected a string.
+END_ERR
+unlink('out2.opus');
+
 sub slurp {
 	my ($filename) = @_;
 	local $/;
@@ -224,6 +281,149 @@ is(md5('out2.opus'), '0a4d20c287b2e46b26cb0eee353c2069', 'the tags were added co
 unlink('out.opus');
 unlink('out2.opus');
 
+# Test --jobs
+my @jobs_files = map { "out$_.opus" } 1..6;
+copy('gobble.opus', $_) foreach @jobs_files;
+is_deeply(opustags('-i', '--jobs=3', '-a', 'FOO=bar', $jobs_files[0], 'missing1.opus', @jobs_files[1..4], 'missing2.opus', $jobs_files[5]), ['', <<'EOF', 256], 'process files in parallel');
+missing1.opus: error: Could not open 'missing1.opus' for reading: No such file or directory
+missing2.opus: error: Could not open 'missing2.opus' for reading: No such file or directory
+EOF
+is_deeply([map { md5($_) } @jobs_files], [('30ba30c4f236c09429473f36f8f861d2') x 6], 'the tags were added in parallel');
+is_deeply(opustags(qw(--jobs 0 out.opus)), ['', <<'EOF', 512], 'invalid number of jobs');
+error: Invalid value for --jobs: 0.
+EOF
+is_deeply(opustags(qw(--jobs -1 out.opus)), ['', <<'EOF', 512], 'negative number of jobs');
+error: Invalid value for --jobs: -1.
+EOF
+is_deeply(opustags(qw(--jobs 2K out.opus)), ['', <<'EOF', 512], 'no suffix for the number of jobs');
+error: Invalid value for --jobs: 2K.
+EOF
+unlink(@jobs_files);
+
+# Test --copy-threads
+copy('gobble.opus', 'out.opus');
+is_deeply(opustags(qw(-i --copy-threads=4 -a FOO=bar out.opus)), ['', '', 0], 'copy the audio on several threads');
+is(md5('out.opus'), '30ba30c4f236c09429473f36f8f861d2', 'the audio was copied correctly');
+is_deeply(opustags(qw(gobble.opus --copy-threads 2 -a BAR=baz -o out.opus -y)), ['', '', 0], 'copy the audio to a new file');
+is(md5('out.opus'), 'f0c80c3f0dbb12819b0506531c326999', 'the audio was copied correctly to the new file');
+is_deeply(opustags(qw(--copy-threads 0 out.opus)), ['', <<'EOF', 512], 'invalid number of copy threads');
+error: Invalid value for --copy-threads: 0.
+EOF
+is_deeply(opustags(qw(--copy-threads 4M out.opus)), ['', <<'EOF', 512], 'no suffix for the number of copy threads');
+error: Invalid value for --copy-threads: 4M.
+EOF
+unlink('out.opus');
+
+# Test --resumable
+copy('gobble.opus', 'out.opus');
+is_deeply(opustags(qw(-i --resumable=1 -a FOO=bar out.opus)), ['', '', 0], 'resumable rewrite');
+is(md5('out.opus'), '30ba30c4f236c09429473f36f8f861d2', 'the resumable rewrite is complete');
+ok(!-e 'out.opus.part' && !-e 'out.opus.part.state', 'no partial file is left after a resumable rewrite');
+is_deeply(opustags(qw(--resumable - -o out.opus)), ['', <<'EOF', 512], 'no resumable rewrite from stdin');
+error: Cannot resume rewrites from standard input.
+EOF
+unlink('out.opus');
+
+# Test --add-index
+copy('gobble.opus', 'out.opus');
+is_deeply(opustags(qw(-i --add-index -a FOO=bar out.opus)), ['', '', 0], 'add an index');
+is(substr(slurp('out.opus'), 28, 8), "fishead\0", 'the file starts with a Skeleton stream');
+is_deeply(opustags('out.opus'), [<<'EOF', '', 0], 'read the tags of an indexed file');
+encoder=Lavc58.18.100 libopus
+FOO=bar
+EOF
+copy('gobble.opus', 'out2.opus');
+opustags(qw(-i -a FOO=bar out2.opus));
+my $manifest = opustags(qw(--manifest - out.opus out2.opus));
+is($manifest->[1], '', 'write the manifest of an indexed file');
+my ($indexed_hashes, $plain_hashes) = map { substr($_, 0, 33) } split(/\n/, $manifest->[0]);
+is($indexed_hashes, $plain_hashes, 'the index does not change the manifest hashes');
+unlink('out2.opus');
+my $indexed_md5 = md5('out.opus');
+is_deeply(opustags(qw(-i -d FOO out.opus)), ['', <<'EOF', 256], 'edit an indexed file without --add-index');
+out.opus: error: Cannot rewrite a file with an Ogg Skeleton stream without --add-index.
+EOF
+is(md5('out.opus'), $indexed_md5, 'the indexed file was left untouched');
+is_deeply(opustags(qw(-i --add-index -d FOO out.opus)), ['', '', 0], 'edit an indexed file');
+is(substr(slurp('out.opus'), 28, 8), "fishead\0", 'the file keeps its Skeleton stream');
+is_deeply(opustags(qw(--add-index out.opus)), ['', <<'EOF', 512], '--add-index requires an output');
+error: Cannot use --add-index without --output or --in-place.
+EOF
+unlink('out.opus');
+
+# Test --manifest and --check-manifest
+copy('gobble.opus', 'out.opus');
+copy('gobble.opus', 'out2.opus');
+is_deeply(opustags(qw(--manifest out.manifest out.opus out2.opus)), ['', '', 0], 'write a manifest');
+is_deeply(opustags(qw(--check-manifest out.manifest --check-audio)), ['', '', 0], 'nothing changed');
+opustags('-i', '-a', 'LARGE=' . ('x' x 70000), 'out.opus');
+is_deeply(opustags(qw(--check-manifest out.manifest --check-audio)), [<<'EOF', '', 256], 'detect a tag change, even with renumbered pages');
+out.opus: headers changed
+EOF
+# Drop the last page.
+my $audio = slurp('out2.opus');
+truncate('out2.opus', rindex($audio, 'OggS')) or die;
+is_deeply(opustags(qw(--check-manifest out.manifest)), [<<'EOF', '', 256], 'only check the headers by default');
+out.opus: headers changed
+EOF
+is_deeply(opustags(qw(--check-manifest out.manifest --check-audio)), [<<'EOF', '', 256], 'detect an audio change');
+out.opus: headers changed
+out2.opus: audio changed
+EOF
+is_deeply(opustags(qw(--check-audio out.opus)), ['', <<'EOF', 512], '--check-audio requires --check-manifest');
+error: Cannot use --check-audio without --check-manifest.
+EOF
+is_deeply(opustags(qw(--manifest out.manifest out.opus -)), ['', <<'EOF', 512], '--manifest cannot read standard input');
+error: Cannot read standard input with --manifest.
+EOF
+unlink('out.opus', 'out2.opus', 'out.manifest');
+
+# Test --expect
+copy('gobble.opus', 'out.opus');
+opustags(qw(-i -a TITLE=Foo -a ARTIST=X -a ARTIST=Y out.opus));
+is_deeply(opustags(qw(--expect - --jobs 2), {in => <<'EOF'}), [<<'EOF', <<'EOF', 256], 'check the expected tags');
+{
+	"out.opus": {"title": "Foo", "ARTIST": ["Y", "X"]},
+	"gobble.opus": ["TITLE=Foo", "ENCODER=Lavc58.18.100 libopus"],
+	"missing.opus": {},
+	"out.opus": {"TITLE": "Bar", "ARTIST": "X", "NOTE": "a\nb \"c\""}
+}
+EOF
+{"path": "gobble.opus", "kind": "missing", "comment": "TITLE=Foo"}
+{"path": "out.opus", "kind": "missing", "comment": "NOTE=a\nb \"c\""}
+{"path": "out.opus", "kind": "missing", "comment": "TITLE=Bar"}
+{"path": "out.opus", "kind": "unexpected", "comment": "ARTIST=Y"}
+{"path": "out.opus", "kind": "unexpected", "comment": "TITLE=Foo"}
+EOF
+missing.opus: error: Could not open 'missing.opus' for reading: No such file or directory
+EOF
+opustags('-i', '--raw', '-a', "BAD=\xffz", 'out.opus');
+is_deeply(opustags(qw(--expect -), {in => '{"out.opus": {"bad": "x"}}'}), [<<'EOF', '', 256], 'invalid UTF-8 in the report');
+{"path": "out.opus", "kind": "missing", "comment": "bad=x"}
+{"path": "out.opus", "kind": "unexpected", "comment": "BAD=\ufffdz"}
+EOF
+is_deeply(opustags(qw(--expect - out.opus)), ['', <<'EOF', 512], 'no input files with --expect');
+error: Cannot specify input files with --expect.
+EOF
+unlink('out.opus');
+
+# Test --emit-delta and --apply-delta
+copy('gobble.opus', 'out.opus');
+is_deeply(opustags(qw(-i out.opus -a TITLE=delta --emit-delta out.delta)), ['', '', 0], 'emit a delta');
+my $edited = md5('out.opus');
+copy('gobble.opus', 'out.opus');
+is_deeply(opustags(qw(--apply-delta out.delta)), ['', '', 0], 'apply a delta');
+is(md5('out.opus'), $edited, 'the delta reproduced the edit');
+is_deeply(opustags(qw(--apply-delta out.delta)), ['', <<'EOF', 256], 'refuse to apply a delta twice');
+out.opus: error: The file size does not match the original file.
+EOF
+is_deeply(opustags(qw(--apply-delta out.delta out.opus)), ['', <<'EOF', 512], 'no input files with --apply-delta');
+error: Cannot specify input files with --apply-delta.
+EOF
+
+unlink('out.opus');
+unlink('out.delta');
+
 ####################################################################################################
 # Interactive edition
 
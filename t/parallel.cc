@@ -0,0 +1,64 @@
+#include <opustags.h>
+#include "tap.h"
+
+#include <thread>
+
+/** Push count results from several threads, in a shuffled order. */
+static std::vector<std::thread> push_results(ot::result_collector& results, size_t count,
+                                             size_t thread_count)
+{
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < thread_count; ++t) {
+		threads.emplace_back([&results, count, thread_count, t] {
+			// Each thread pushes its indices from the last one to the first one.
+			for (size_t i = count - thread_count + t; i < count; i -= thread_count) {
+				ot::file_result result;
+				result.index = i;
+				result.path = std::to_string(i);
+				results.push(std::move(result));
+			}
+		});
+	}
+	return threads;
+}
+
+static void check_ordered()
+{
+	constexpr size_t count = 1000;
+	ot::result_collector results(true);
+	auto threads = push_results(results, count, 4);
+	size_t expected = 0;
+	results.collect(count, [&expected](ot::file_result& result) {
+		if (result.index != expected || result.path != std::to_string(expected))
+			throw failure("the results were not delivered in order");
+		++expected;
+	});
+	for (std::thread& t : threads)
+		t.join();
+	is(expected, count, "all the results were delivered");
+}
+
+static void check_unordered()
+{
+	constexpr size_t count = 1000;
+	ot::result_collector results(false);
+	auto threads = push_results(results, count, 4);
+	std::vector<bool> seen(count);
+	results.collect(count, [&seen](ot::file_result& result) {
+		if (seen[result.index])
+			throw failure("a result was delivered twice");
+		seen[result.index] = true;
+	});
+	for (std::thread& t : threads)
+		t.join();
+	if (std::find(seen.begin(), seen.end(), false) != seen.end())
+		throw failure("a result was not delivered");
+}
+
+int main(int argc, char **argv)
+{
+	std::cout << "1..2\n";
+	run(check_ordered, "collect results in order");
+	run(check_unordered, "collect results as they come");
+	return 0;
+}
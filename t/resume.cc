@@ -0,0 +1,126 @@
+#include <opustags.h>
+#include "tap.h"
+
+#include <string.h>
+#include <unistd.h>
+
+using namespace std::literals::string_literals;
+
+static const char* resume_target = "resume.test.opus";
+static const char* resume_part = "resume.test.opus.part";
+
+static void check_state_file()
+{
+	is(ot::rewrite_state_path("a.opus"), "a.opus.part.state", "state path");
+	const char* path = "resume.test.state";
+	ot::rewrite_state state {};
+	state.input = ot::get_file_identity("gobble.opus");
+	state.header_checksum = 0xfedcba9876543210;
+	state.header_length = 100;
+	state.input_offset = 1234;
+	state.output_offset = 1300;
+	state.last_page_offset = 1200;
+	state.last_pageno = 7;
+	ot::save_rewrite_state(path, state);
+
+	ot::rewrite_state loaded {};
+	if (!ot::load_rewrite_state(path, loaded))
+		throw failure("could not load the state");
+	if (!(loaded.input == state.input) || loaded.header_checksum != state.header_checksum ||
+	    loaded.header_length != state.header_length || loaded.input_offset != state.input_offset ||
+	    loaded.output_offset != state.output_offset ||
+	    loaded.last_page_offset != state.last_page_offset || loaded.last_pageno != state.last_pageno)
+		throw failure("the state loaded differs");
+
+	write_file(path, "OTState1 1 2 3\n");
+	if (ot::load_rewrite_state(path, loaded))
+		throw failure("loaded a truncated state");
+	is(remove(path), 0, "remove the state file");
+	if (ot::load_rewrite_state(path, loaded))
+		throw failure("loaded a missing state");
+}
+
+/**
+ * Interrupt a rewrite with an error at the end of the input, then fix the input and resume. To
+ * prove that the pages copied by the first attempt were not copied again, one of them is
+ * corrupted in the partial file in between.
+ */
+static void check_resume()
+{
+	ot::options opt;
+	opt.paths_in = {"gobble.opus"};
+	opt.path_out = resume_target;
+	opt.overwrite = true;
+	opt.to_add = {"TITLE=resumed"};
+	ot::run(opt);
+	std::string expected = read_file(resume_target);
+
+	std::string original = read_file("gobble.opus");
+	write_file(resume_target, original + "junk");
+	opt.paths_in = {resume_target};
+	opt.path_out.reset();
+	opt.in_place = true;
+	opt.checkpoint_interval = 1;
+	try {
+		ot::run(opt);
+		throw failure("the junk at the end of the file was not detected");
+	} catch (const ot::status& rc) {
+		is(rc, ot::st::error, "interrupted rewrite");
+	}
+
+	ot::rewrite_state state;
+	if (!ot::load_rewrite_state(ot::rewrite_state_path(resume_target), state))
+		throw failure("the state was not saved");
+	is(state.input_offset, original.size(), "all the pages were copied");
+	{
+		ot::file partial = fopen(resume_part, "r");
+		if (partial == nullptr || !ot::check_tail_page(partial.get(), state))
+			throw failure("the partial file is not intact");
+	}
+
+	// Fix the input, and pretend it was not modified.
+	if (truncate(resume_target, original.size()) == -1)
+		throw failure("could not truncate the input");
+	state.input = ot::get_file_identity(resume_target);
+	ot::save_rewrite_state(ot::rewrite_state_path(resume_target), state);
+	std::string partial = read_file(resume_part);
+	size_t corrupted = state.header_length + 40;
+	partial[corrupted] ^= 1;
+	write_file(resume_part, partial + "garbage after the last checkpoint");
+
+	ot::run(opt);
+	expected[corrupted] ^= 1;
+	if (read_file(resume_target) != expected)
+		throw failure("the rewrite was not resumed");
+	if (access(resume_part, F_OK) == 0 || access(ot::rewrite_state_path(resume_target).c_str(), F_OK) == 0)
+		throw failure("the partial file or the state was left behind");
+	is(remove(resume_target), 0, "remove the test file");
+}
+
+/** The partial file has a predictable name, so a symlink in its place must not be followed. */
+static void check_symlink()
+{
+	const char* victim = "resume.test.victim";
+	write_file(victim, "precious");
+	if (symlink(victim, resume_part) == -1)
+		throw failure("could not create the symlink");
+	ot::partial_file partial;
+	try {
+		partial.open_resumable(resume_target, false);
+		throw failure("the symlink was followed");
+	} catch (const ot::status& rc) {
+		is(rc, ot::st::standard_error, "refuse to follow a symlink");
+	}
+	is(read_file(victim), "precious", "the symlink target was left untouched");
+	is(remove(resume_part), 0, "remove the symlink");
+	is(remove(victim), 0, "remove the symlink target");
+}
+
+int main(int argc, char **argv)
+{
+	std::cout << "1..3\n";
+	run(check_state_file, "save and load the state of a rewrite");
+	run(check_resume, "resume an interrupted rewrite");
+	run(check_symlink, "do not follow a symlink to the partial file");
+	return 0;
+}
@@ -0,0 +1,165 @@
+#include <opustags.h>
+#include "tap.h"
+
+#include <string.h>
+
+using namespace std::literals::string_literals;
+
+static const char* skeleton_target = "skeleton.test.opus";
+static const int serialno = 1234;
+static const long audio_page_count = 200;
+static const long audio_packet_size = 4000;
+/** Size of an audio page, with its 16 lacing values. */
+static const uint64_t page_size = 27 + 16 + audio_packet_size;
+
+static uint64_t get_integer(const unsigned char* in, int size)
+{
+	uint64_t value = 0;
+	for (int i = size - 1; i >= 0; --i)
+		value = (value << 8) | in[i];
+	return value;
+}
+
+static uint64_t get_varint(const unsigned char*& in)
+{
+	uint64_t value = 0;
+	for (int shift = 0; ; shift += 7) {
+		value |= static_cast<uint64_t>(*in & 0x7F) << shift;
+		if (*in++ & 0x80)
+			return value;
+	}
+}
+
+/**
+ * Build an Opus stream with a pre-skip of 312 samples, followed by pages of 20 ms each holding a
+ * single packet, large enough to need several keypoints.
+ */
+static void write_test_stream()
+{
+	ot::file output = fopen(skeleton_target, "w");
+	ot::ogg_writer writer(output.get());
+	ot::dynamic_ogg_packet id(19);
+	memcpy(id.packet, "OpusHead\x01\x02\x38\x01\x80\xbb\x00\x00\x00\x00\x00", 19);
+	id.b_o_s = 1;
+	id.e_o_s = 0;
+	id.granulepos = 0;
+	id.packetno = 0;
+	writer.write_header_packet(serialno, 0, id);
+	ot::opus_tags tags;
+	tags.vendor = "opustags test";
+	ot::dynamic_ogg_packet comments = ot::render_tags(tags);
+	writer.write_header_packet(serialno, 1, comments);
+	for (long i = 0; i < audio_page_count; ++i) {
+		ot::dynamic_ogg_packet audio(audio_packet_size);
+		memset(audio.packet, i & 0xFF, audio_packet_size);
+		audio.b_o_s = 0;
+		audio.e_o_s = (i == audio_page_count - 1);
+		audio.granulepos = 312 + 960 * (i + 1);
+		audio.packetno = 2 + i;
+		writer.write_header_packet(serialno, 2 + i, audio);
+	}
+}
+
+static void check_index()
+{
+	write_test_stream();
+	std::string original = read_file(skeleton_target);
+	ot::file_digest original_digest = ot::digest_file(ot::file(fopen(skeleton_target, "r")).get(), true);
+	ot::options opt;
+	opt.paths_in = {skeleton_target};
+	opt.in_place = true;
+	opt.overwrite = true;
+	opt.add_index = true;
+	ot::run(opt);
+	std::string indexed = read_file(skeleton_target);
+
+	// Gather the Skeleton packets.
+	ot::file input = fopen(skeleton_target, "r");
+	ot::ogg_reader reader(input.get());
+	if (!reader.next_page() || !ot::is_skeleton_stream(reader.page))
+		throw failure("the first page is not a fishead");
+	int skeleton_serialno = ogg_page_serialno(&reader.page);
+	ot::ogg_logical_stream skeleton(skeleton_serialno);
+	std::vector<ot::dynamic_ogg_packet> packets;
+	do {
+		if (ogg_page_serialno(&reader.page) != skeleton_serialno)
+			continue;
+		if (ogg_stream_pagein(&skeleton, &reader.page) != 0)
+			throw failure("ogg_stream_pagein failed");
+		ogg_packet op;
+		while (ogg_stream_packetout(&skeleton, &op) == 1)
+			packets.emplace_back(op);
+	} while (reader.next_page());
+	is(packets.size(), 4u, "fishead, fisbone, index and end packets");
+
+	const unsigned char* head = packets[0].packet;
+	is(get_integer(head + 8, 2), 4u, "Skeleton version");
+	is(get_integer(head + 64, 8), indexed.size(), "segment length");
+	uint64_t content_offset = get_integer(head + 72, 8);
+	if (indexed.compare(content_offset, std::string::npos,
+	                    original, original.size() - audio_page_count * page_size,
+	                    std::string::npos) != 0)
+		throw failure("the audio pages do not start at the content offset");
+
+	const unsigned char* bone = packets[1].packet;
+	if (memcmp(bone, "fisbone\0", 8) != 0 || get_integer(bone + 12, 4) != serialno)
+		throw failure("bad fisbone packet");
+	is(get_integer(bone + 16, 4), 2u, "number of header packets");
+	is(get_integer(bone + 20, 8), 48000u, "granule rate");
+	is(get_integer(bone + 36, 8), 312u, "base granule");
+
+	const unsigned char* index = packets[2].packet;
+	if (memcmp(index, "index\0", 6) != 0 || get_integer(index + 6, 4) != serialno)
+		throw failure("bad index packet");
+	// Keypoints are on the first page at least keypoint_spacing bytes after the previous one.
+	uint64_t keypoint_count = get_integer(index + 10, 8);
+	uint64_t pages_per_keypoint = (ot::skeleton_index::keypoint_spacing + page_size - 1) / page_size;
+	is(keypoint_count, (audio_page_count + pages_per_keypoint - 1) / pages_per_keypoint,
+	   "number of keypoints");
+	is(get_integer(index + 34, 8), static_cast<uint64_t>(audio_page_count * 20), "last sample time");
+	const unsigned char* point = index + 42;
+	uint64_t offset = 0;
+	uint64_t time = 0;
+	for (uint64_t i = 0; i < keypoint_count; ++i) {
+		uint64_t previous = offset;
+		offset += get_varint(point);
+		time += get_varint(point);
+		if (i == 0 ? offset != content_offset : offset - previous < ot::skeleton_index::keypoint_spacing)
+			throw failure("misplaced keypoint");
+		if (indexed.compare(offset, 4, "OggS") != 0)
+			throw failure("the keypoint does not point to a page");
+		uint64_t page_index = (offset - content_offset) / page_size;
+		if (time != page_index * 20)
+			throw failure("wrong keypoint time");
+	}
+
+	// The digest of the manifests ignores the Skeleton stream.
+	ot::file_digest indexed_digest = ot::digest_file(ot::file(fopen(skeleton_target, "r")).get(), true);
+	if (indexed_digest.headers != original_digest.headers || indexed_digest.audio != original_digest.audio)
+		throw failure("the index changed the digest of the file");
+
+	// Rewriting the file again with --add-index replaces the Skeleton stream.
+	ot::run(opt);
+	if (read_file(skeleton_target) != indexed)
+		throw failure("the Skeleton stream was not replaced");
+
+	// Without --add-index, the file is refused rather than losing its index.
+	opt.add_index = false;
+	try {
+		ot::run(opt);
+		throw failure("rewriting an indexed file without --add-index should fail");
+	} catch (const ot::status& rc) {
+		if (rc != ot::st::error)
+			throw failure("unexpected error code");
+	}
+	if (read_file(skeleton_target) != indexed)
+		throw failure("the indexed file was modified");
+	is(remove(skeleton_target), 0, "remove the test file");
+}
+
+int main(int argc, char **argv)
+{
+	std::cout << "1..1\n";
+	run(check_index, "index an Opus stream");
+	return 0;
+}
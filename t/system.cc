@@ -47,6 +47,19 @@ void check_converter()
 		from_utf8("\xFF\xFF");
 		throw failure("conversion from bad UTF-8 did not fail");
 	} catch (const ot::status&) {}
+
+	ot::encoding_converter utf8_to_utf8("UTF-8", "utf8");
+	is(utf8_to_utf8("Éphémère 𝄞"), "Éphémère 𝄞", "UTF-8 is passed through");
+	for (const char* bad : {"\xC0\xAF", "\xE0\x80\xAF", "\xED\xA0\x80", "\xF4\x90\x80\x80", "\xE2\x82"}) {
+		if (ot::is_utf8(bad))
+			throw failure("accepted invalid UTF-8");
+		try {
+			utf8_to_utf8(bad);
+			throw failure("passed invalid UTF-8 through");
+		} catch (const ot::status& rc) {
+			is(rc, ot::st::badly_encoded, "invalid UTF-8 is rejected");
+		}
+	}
 }
 
 void check_shell_esape()
@@ -57,11 +70,68 @@ void check_shell_esape()
 	is(ot::shell_escape("a!b'c!d'e"), "'a'\\!'b'\\''c'\\!'d'\\''e'", "string with a bang");
 }
 
+void check_io_limiter()
+{
+	using namespace std::chrono;
+	ot::io_limiter limiter(1000000, 0);
+	auto start = steady_clock::now();
+	limiter.acquire(500000);
+	limiter.acquire(500000);
+	if (steady_clock::now() - start > milliseconds(50))
+		throw failure("the initial burst should not have been throttled");
+	limiter.acquire(100000);
+	if (steady_clock::now() - start < milliseconds(90))
+		throw failure("exceeding the budget should have been throttled");
+}
+
+void check_copy_range()
+{
+	static const char* input_path = "copy_range.test.in";
+	static const char* output_path = "copy_range.test.out";
+	std::string data(300000, '\0');
+	for (size_t i = 0; i < data.size(); ++i)
+		data[i] = static_cast<char>(i * 7 + i / 251);
+	ot::file input = fopen(input_path, "w+");
+	ot::file output = fopen(output_path, "w+");
+	if (input == nullptr || output == nullptr)
+		throw failure("could not create the test files");
+	if (fwrite(data.data(), 1, data.size(), input.get()) < data.size() || fflush(input.get()) != 0)
+		throw failure("could not write the input file");
+
+	// Unaligned offsets, so that the first and last chunks are partial.
+	ot::copy_range(fileno(input.get()), 1000, fileno(output.get()), 77, 250000, 4, nullptr, 65536);
+	std::string copy(250077, '\0');
+	if (pread(fileno(output.get()), copy.data(), copy.size(), 0) != 250077)
+		throw failure("the output has the wrong size");
+	if (copy.compare(0, 77, std::string(77, '\0')) != 0)
+		throw failure("the data before the output offset was modified");
+	if (copy.compare(77, 250000, data, 1000, 250000) != 0)
+		throw failure("the range was not copied correctly");
+
+	// The limiter is charged for both the read and the write, so 500000 bytes for this copy.
+	ot::io_limiter limiter(400000, 0);
+	auto start = std::chrono::steady_clock::now();
+	ot::copy_range(fileno(input.get()), 0, fileno(output.get()), 0, 250000, 1, &limiter, 65536);
+	if (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(200))
+		throw failure("the copy should have been throttled");
+
+	try {
+		ot::copy_range(fileno(input.get()), 200000, fileno(output.get()), 0, 200000, 2, nullptr, 65536);
+		throw failure("copying past the end of the input should fail");
+	} catch (const ot::status& rc) {
+		is(rc.message, "Unexpected end of file.", "copying past the end of the input fails");
+	}
+	is(remove(input_path), 0, "remove the input file");
+	is(remove(output_path), 0, "remove the output file");
+}
+
 int main(int argc, char **argv)
 {
-	plan(3);
+	plan(5);
 	run(check_partial_files, "test partial files");
 	run(check_converter, "test encoding converter");
 	run(check_shell_esape, "test shell escaping");
+	run(check_io_limiter, "test the I/O limiter");
+	run(check_copy_range, "test the parallel copy");
 	return 0;
 }
@@ -8,12 +8,15 @@
  * https://perldoc.perl.org/Test/More.html
  *
  * Unlike Test::More, a test failure raises an exception and aborts the whole subtest.
+ *
+ * It also provides helpers to read and write the files the tests work on.
  */
 
 #pragma once
 
 #include <exception>
 #include <iostream>
+#include <string>
 
 inline namespace tap {
 
@@ -41,6 +44,28 @@ void plan(int tests)
 	std::cout << "1.." << tests << "\n";
 }
 
+/** Read a whole file into a string. */
+std::string read_file(const char* path)
+{
+	ot::file input = fopen(path, "r");
+	if (input == nullptr)
+		throw failure(std::string("could not open ") + path);
+	std::string contents;
+	char buffer[4096];
+	size_t len;
+	while ((len = fread(buffer, 1, sizeof(buffer), input.get())) > 0)
+		contents.append(buffer, len);
+	return contents;
+}
+
+/** Replace the contents of a file, creating it if needed. */
+void write_file(const char* path, const std::string& contents)
+{
+	ot::file output = fopen(path, "w");
+	if (output == nullptr || fwrite(contents.data(), 1, contents.size(), output.get()) != contents.size())
+		throw failure(std::string("could not write ") + path);
+}
+
 template <typename T, typename U>
 void is(const T& got, const U& expected, const char* name)
 {